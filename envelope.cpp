@@ -0,0 +1,223 @@
+/* envelope.cpp
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "envelope.h"
+#include "grainmap.h"
+#include "parallel.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <math.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+envelope::envelope(const audio_data& adata) : adata(adata) {
+  int64_t blocks = (adata.size + block_size-1) >> block_shift;
+  levels.push_back(vector<envelope_point>(blocks));
+  vector<envelope_point>& bottom = levels[0];
+  parallel_for(0, blocks, [&](int, size_t begin, size_t end) {
+      for (int64_t b=begin; b<(int64_t)end; b++)
+        bottom[b] = scan(b << block_shift, min((b+1) << block_shift, adata.size));
+    });
+
+  while (levels.back().size() > 1) {
+    const vector<envelope_point>& below = levels.back();
+    vector<envelope_point> above((below.size()+1)/2);
+    for (size_t i=0; i<below.size(); i++)
+      above[i/2].merge(below[i]);
+    levels.push_back(move(above));
+  }
+}
+
+envelope_point envelope::scan(int64_t begin, int64_t end) const {
+  envelope_point p;
+  for (int chan=0; chan<adata.channels; chan++) {
+    const float* data = adata.data[chan];
+    int64_t i = begin;
+#ifdef __SSE__
+    if (end - begin >= 8) {
+      __m128 mn = _mm_set1_ps(p.min);
+      __m128 mx = _mm_set1_ps(p.max);
+      __m128 sq = _mm_setzero_ps();
+      for (; i+4 <= end; i += 4) {
+        __m128 v = _mm_loadu_ps(data + i);
+        mn = _mm_min_ps(mn, v);
+        mx = _mm_max_ps(mx, v);
+        sq = _mm_add_ps(sq, _mm_mul_ps(v, v));
+      }
+      float lanes[3][4];
+      _mm_storeu_ps(lanes[0], mn);
+      _mm_storeu_ps(lanes[1], mx);
+      _mm_storeu_ps(lanes[2], sq);
+      for (int k=0; k<4; k++) {
+        p.min = min(p.min, lanes[0][k]);
+        p.max = max(p.max, lanes[1][k]);
+        p.sum_sq += lanes[2][k];
+      }
+    }
+#endif
+    for (; i<end; i++)
+      p.add(data[i]);
+  }
+  return p;
+}
+
+size_t envelope::memory_size() const {
+  size_t size = 0;
+  for (size_t i=0; i<levels.size(); i++)
+    size += levels[i].capacity()*sizeof(envelope_point);
+  return size;
+}
+
+envelope_point envelope::query(int64_t begin, int64_t end) const {
+  assert(begin >= 0 && begin < end && end <= adata.size);
+  const int64_t blocks = levels[0].size();
+  int64_t first, last;
+  envelope_point p;
+  if (end - begin >= 16*block_size) {
+    // off by at most half a block at each end, which no pixel this
+    // wide will show
+    first = (begin + block_size/2) >> block_shift;
+    last = end == adata.size ? blocks : (end + block_size/2) >> block_shift;
+  } else {
+    first = (begin + block_size-1) >> block_shift;
+    last = end >> block_shift;
+    if (first >= last)
+      return scan(begin, end);
+    p.merge(scan(begin, first << block_shift));
+    p.merge(scan(last << block_shift, end));
+  }
+
+  for (int k=0; first < last; k++) {
+    if (first & 1) p.merge(levels[k][first++]);
+    if (last & 1) p.merge(levels[k][--last]);
+    first >>= 1;
+    last >>= 1;
+  }
+  return p;
+}
+
+void channel_abs_max(const audio_data& adata, int64_t begin, int64_t end,
+                     float* out)
+{
+  // a block at a time, so out stays in cache across channels
+  const int64_t block = 1024;
+  for (int64_t b=begin; b<end; b+=block) {
+    const int64_t n = min(block, end-b);
+    float* o = out + (b-begin);
+    fill(o, o+n, 0.0f);
+    for (int chan=0; chan<adata.channels; chan++) {
+      const float* data = adata.data[chan] + b;
+      int64_t i = 0;
+#ifdef __SSE__
+      const __m128 sign = _mm_set1_ps(-0.0f);
+      for (; i+4 <= n; i += 4)
+        _mm_storeu_ps(o+i, _mm_max_ps(_mm_loadu_ps(o+i),
+                                      _mm_andnot_ps(sign, _mm_loadu_ps(data+i))));
+#endif
+      for (; i<n; i++)
+        o[i] = max(o[i], fabsf(data[i]));
+    }
+  }
+}
+
+static inline float follow_step(float x, float level, float decay) {
+  x = fabsf(x);
+  return max(x, decay*level + (1-decay)*x);
+}
+
+static float follow_run(const float* in, float* out, int64_t n, float decay,
+                        float level)
+{
+  for (int64_t i=0; i<n; i++)
+    out[i] = level = follow_step(in[i], level, decay);
+  return level;
+}
+
+// Follow the four runs of len samples starting at in, in+len, in+2*len
+// and in+3*len together, one per lane, each from 0.
+static void follow_lanes(const float* in, float* out, int64_t len, float decay) {
+  int64_t i = 0;
+#ifdef __SSE__
+  const __m128 d = _mm_set1_ps(decay);
+  const __m128 rest = _mm_set1_ps(1-decay);
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  __m128 y = _mm_setzero_ps();
+  for (; i+4 <= len; i += 4) {
+    __m128 r[4];
+    for (int lane=0; lane<4; lane++)
+      r[lane] = _mm_loadu_ps(in + lane*len + i);
+    // now r[k] holds step i+k of every run
+    _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+    for (int k=0; k<4; k++) {
+      __m128 x = _mm_andnot_ps(sign, r[k]);
+      r[k] = y = _mm_max_ps(x, _mm_add_ps(_mm_mul_ps(d, y), _mm_mul_ps(rest, x)));
+    }
+    _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+    for (int lane=0; lane<4; lane++)
+      _mm_storeu_ps(out + lane*len + i, r[lane]);
+  }
+  float level[4];
+  _mm_storeu_ps(level, y);
+#else
+  float level[4] = {0, 0, 0, 0};
+#endif
+  for (; i<len; i++)
+    for (int lane=0; lane<4; lane++)
+      out[lane*len + i] = level[lane] = follow_step(in[lane*len + i], level[lane], decay);
+}
+
+// Redo a run that was followed from 0 now that the level coming into
+// it is known.  The two only differ by a decaying amount, so stop once
+// that is too small to show.
+static float restitch(const float* in, float* out, int64_t n, float decay,
+                      float level)
+{
+  for (int64_t i=0; i<n; i++) {
+    level = follow_step(in[i], level, decay);
+    bool settled = level - out[i] <= out[i]*(1.0f/65536);
+    out[i] = level;
+    if (settled)
+      return out[n-1];
+  }
+  return level;
+}
+
+float follow_peaks(const float* in, float* out, int64_t n, float decay,
+                   float level, int threads)
+{
+  if (threads <= 0)
+    threads = default_threads();
+  const int runs = 4*threads;
+  const int64_t len = n/runs;
+  if (len < 64)
+    return follow_run(in, out, n, decay, level);
+
+  parallel_for(threads, threads, [&](int, size_t begin, size_t end) {
+      for (size_t t=begin; t<end; t++)
+        follow_lanes(in + 4*t*len, out + 4*t*len, len, decay);
+    });
+  for (int r=0; r<runs; r++)
+    level = restitch(in + r*len, out + r*len, len, decay, level);
+  return follow_run(in + runs*len, out + runs*len, n - runs*len, decay, level);
+}
@@ -0,0 +1,95 @@
+/* envelope.h
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENVELOPE_H
+#define ENVELOPE_H
+
+#include <vector>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+
+struct audio_data;
+
+// Minimum, maximum and sum of squares of a run of samples, over every
+// channel
+struct envelope_point {
+  float min, max, sum_sq;
+
+  envelope_point() : min(FLT_MAX), max(-FLT_MAX), sum_sq(0) {}
+
+  void add(float v) {
+    if (v < min) min = v;
+    if (v > max) max = v;
+    sum_sq += v*v;
+  }
+
+  void merge(const envelope_point& p) {
+    if (p.min < min) min = p.min;
+    if (p.max > max) max = p.max;
+    sum_sq += p.sum_sq;
+  }
+
+  float peak() const {
+    return max > -min ? max : -min;
+  }
+
+  // count is the number of values summed, i.e. samples times channels
+  float rms(int64_t count) const {
+    return count ? sqrtf(sum_sq/count) : 0;
+  }
+};
+
+// Envelopes of fixed blocks of samples, then of pairs of blocks, and
+// so on up to the whole file, so the envelope of any range of samples
+// takes a few lookups however long it is.
+class envelope {
+  const audio_data& adata;
+  std::vector<std::vector<envelope_point> > levels;
+
+  envelope_point scan(int64_t begin, int64_t end) const;
+
+public:
+  static const int block_shift = 8;
+  static const int64_t block_size = 1 << block_shift;
+
+  explicit envelope(const audio_data& adata);
+
+  // Envelope of samples [begin, end).  Ranges of many blocks are
+  // rounded to whole blocks.
+  envelope_point query(int64_t begin, int64_t end) const;
+  size_t memory_size() const;
+};
+
+// out[i] = the largest |sample| over every channel, for samples
+// [begin, end)
+void channel_abs_max(const audio_data& adata, int64_t begin, int64_t end,
+                     float* out);
+
+// One-pole peak follower over |in|: out[i] = max(|x|, decay*y + (1-decay)*|x|)
+// where y is the previous output, starting from level.  Returns the
+// last output.  The samples are split into runs that are followed
+// independently, four to a SIMD register and on threads threads, and
+// then each run is redone from the level the run before it ended on
+// until the two agree.
+float follow_peaks(const float* in, float* out, int64_t n, float decay,
+                   float level = 0, int threads = 0);
+
+#endif //ENVELOPE_H
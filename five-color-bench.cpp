@@ -0,0 +1,143 @@
+/* five-color-bench.cpp
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "five-color.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+
+typedef vector<vector<int> > adjacency;
+
+// w*h grid with one random diagonal per cell: planar, degree <= 8,
+// and close to the degree mix of a dense region map.
+static adjacency triangulated_grid(int w, int h) {
+  adjacency adj(w*h);
+  auto link = [&](int a, int b) {
+    adj[a].push_back(b);
+    adj[b].push_back(a);
+  };
+
+  for (int y=0; y<h; y++) {
+    for (int x=0; x<w; x++) {
+      int v = y*w + x;
+      if (x+1 < w) link(v, v+1);
+      if (y+1 < h) link(v, v+w);
+      if (x+1 < w && y+1 < h) {
+        if (rand() & 1)
+          link(v, v+w+1);
+        else
+          link(v+1, v+w);
+      }
+    }
+  }
+
+  return adj;
+}
+
+static double ms_since(chrono::steady_clock::time_point t) {
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - t).count();
+}
+
+static double build(five_color& fc, const adjacency& adj,
+                    vector<five_color::vertex*>& v)
+{
+  auto t = chrono::steady_clock::now();
+  fc.reset();
+  fc.reserve(adj.size(), 6*adj.size());
+  v.resize(adj.size());
+  for (size_t i=0; i<adj.size(); i++)
+    v[i] = fc.create_vertex();
+  for (size_t i=0; i<adj.size(); i++)
+    for (size_t j=0; j<adj[i].size(); j++)
+      fc.add_edge(v[i], v[adj[i][j]]);
+  return ms_since(t);
+}
+
+static void bench(int regions) {
+  int w = (int)sqrt((double)regions);
+  adjacency adj = triangulated_grid(w, w);
+
+  // the second build reuses the first one's storage, as back-to-back
+  // loads do
+  five_color fc;
+  vector<five_color::vertex*> v;
+  double cold = build(fc, adj, v);
+  fc.color();
+  double warm = build(fc, adj, v);
+
+  auto t = chrono::steady_clock::now();
+  fc.color();
+  double color = ms_since(t);
+  bool valid = fc.validate();
+
+  build(fc, adj, v);
+  t = chrono::steady_clock::now();
+  fc.color_fast();
+  double fast = ms_since(t);
+  valid &= fc.validate();
+
+  printf("%9zu %10.2f %10.2f %10.2f %10.2f %12.0f %6s\n",
+         adj.size(), cold, warm, color, fast, adj.size()/(fast/1000),
+         valid ? "yes" : "NO");
+}
+
+static void bench_parallel(int regions) {
+  int w = (int)sqrt((double)regions);
+  adjacency adj = triangulated_grid(w, w);
+  five_color fc;
+  vector<five_color::vertex*> v;
+  double base = 0;
+
+  for (int threads=1; threads<=32; threads*=2) {
+    build(fc, adj, v);
+    auto t = chrono::steady_clock::now();
+    fc.color_parallel(threads);
+    double color = ms_since(t);
+    if (threads == 1)
+      base = color;
+
+    t = chrono::steady_clock::now();
+    bool valid = fc.validate(threads);
+    double validate = ms_since(t);
+
+    printf("%9zu %7d %10.2f %8.2fx %11.2f %6s\n",
+           adj.size(), threads, color, base/color, validate,
+           valid ? "yes" : "NO");
+  }
+}
+
+int main(int argc, char* argv[]) {
+  srand(1);
+  printf("%9s %10s %10s %10s %10s %12s %6s\n",
+         "regions", "cold ms", "warm ms", "color ms", "fast ms", "regions/s", "valid");
+  for (int n=10000; n<=1000000; n*=10)
+    bench(n);
+
+  printf("\n%9s %7s %10s %9s %11s %6s\n",
+         "regions", "threads", "color ms", "speedup", "validate ms", "valid");
+  for (int n=100000; n<=1000000; n*=10)
+    bench_parallel(n);
+  return 0;
+}
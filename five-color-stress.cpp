@@ -0,0 +1,216 @@
+/* five-color-stress.cpp
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Random region maps over Hilbert grids: cross-checks the boundary
+// walk against a raster scan, checks each outline polygon encloses
+// exactly its region's pixels, colors every map both ways, validates in
+// parallel and reports time and memory against region count.  Exits
+// nonzero on the first disagreement, so it doubles as a test.
+
+#include "five-color.h"
+#include "region-graph.h"
+#include "parallel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <chrono>
+
+using namespace std;
+
+static double ms_since(chrono::steady_clock::time_point t) {
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - t).count();
+}
+
+static double resident_mb() {
+  long pages = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%*s %ld", &pages) != 1)
+      pages = 0;
+    fclose(f);
+  }
+  return pages*(double)sysconf(_SC_PAGESIZE)/(1 << 20);
+}
+
+// Onsets as a Bernoulli process with the given density per index,
+// drawn as geometric gaps.  Index 0 always starts a region, as in
+// read_and_detect().
+static void partition(five_color& fc, region_map& regions, int nsize, double density) {
+  int size = 1 << 2*nsize;
+  regions.clear();
+  fc.reset();
+  for (int i=0; i<size;) {
+    regions.insert(region_map::value_type(i, 0));
+    double u = (rand() + 1.0)/(RAND_MAX + 2.0);
+    i += 1 + (int)(log(u)/log1p(-density));
+  }
+  fc.reserve(regions.size(), 6*regions.size());
+  for (auto it=regions.begin(); it != regions.end(); ++it)
+    it->second = fc.create_vertex();
+}
+
+// Every outline must enclose as many pixels as its region holds
+static bool check_outlines(region_map& regions, int nsize) {
+  region_outlines outlines;
+  extract_outlines(regions, nsize, outlines);
+  if (outlines.size() != (int)regions.size()) {
+    fprintf(stderr, "nsize %d: %d outlines for %zu regions\n",
+            nsize, outlines.size(), regions.size());
+    return false;
+  }
+
+  const int64_t size = (int64_t)1 << 2*nsize;
+  auto it = regions.begin();
+  for (int i=0; i<outlines.size(); i++) {
+    int64_t start = it->first;
+    ++it;
+    int64_t end = it == regions.end() ? size : min(it->first, size);
+    int64_t twice_area = 0;
+    size_t begin = outlines.offsets[i], stop = outlines.offsets[i+1];
+    for (size_t k=begin; k<stop; k++) {
+      const outline_point& a = outlines.points[k];
+      const outline_point& b = outlines.points[k+1 < stop ? k+1 : begin];
+      twice_area += (int64_t)a.x*b.y - (int64_t)b.x*a.y;
+    }
+    if (twice_area != 2*(end - start)) {
+      fprintf(stderr, "nsize %d: region at %lld has %lld pixels but its "
+              "outline encloses %g\n", nsize, (long long)start,
+              (long long)(end - start), twice_area/2.0);
+      return false;
+    }
+  }
+  return true;
+}
+
+// The single-region walks used for edits must agree with the full ones
+static bool check_local(region_map& regions, int nsize, const region_pairs& pairs) {
+  region_table table;
+  for (auto it=regions.begin(); it!=regions.end(); ++it) {
+    region_start r = {it->first, 0};
+    table.insert(table.end(), region_table::value_type(it->first, r));
+  }
+  region_outlines all;
+  extract_outlines(regions, nsize, all);
+
+  const int step = max((int)regions.size()/200, 1);
+  for (int i=0; i<all.size(); i += step) {
+    const int64_t start = all.starts[i];
+    vector<int64_t> neighbours;
+    region_neighbours(table, start, nsize, neighbours);
+    sort(neighbours.begin(), neighbours.end());
+    neighbours.erase(unique(neighbours.begin(), neighbours.end()), neighbours.end());
+    auto lo = lower_bound(pairs.begin(), pairs.end(), make_pair(start, (int64_t)INT64_MIN));
+    size_t n = 0;
+    for (auto it=lo; it != pairs.end() && it->first == start; ++it, ++n)
+      if (n >= neighbours.size() || neighbours[n] != it->second)
+        break;
+    bool same = n == neighbours.size() &&
+      (lo + n == pairs.end() || (lo + n)->first != start);
+
+    region_outlines one;
+    append_outline(table, start, nsize, one);
+    same &= one.offsets[1] == all.offsets[i+1] - all.offsets[i] &&
+      equal(one.points.begin(), one.points.end(), all.points.begin() + all.offsets[i],
+            [](const outline_point& a, const outline_point& b) {
+              return a.x == b.x && a.y == b.y;
+            });
+    if (!same) {
+      fprintf(stderr, "nsize %d: region at %lld walks differently alone\n",
+              nsize, (long long)start);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool run(int nsize, double density, int threads) {
+  five_color fc;
+  region_map regions;
+  region_pairs boundary, raster;
+
+  partition(fc, regions, nsize, density);
+
+  auto t = chrono::steady_clock::now();
+  boundary_adjacency(regions, nsize, boundary);
+  double walk = ms_since(t);
+
+  t = chrono::steady_clock::now();
+  raster_adjacency(regions, nsize, raster);
+  double scan = ms_since(t);
+
+  bool ok = boundary == raster;
+  if (!ok) {
+    size_t i = 0;
+    while (i < boundary.size() && i < raster.size() && boundary[i] == raster[i])
+      i++;
+    fprintf(stderr, "nsize %d density %g: adjacency differs at pair %zu "
+            "(boundary %zu pairs, raster %zu)\n",
+            nsize, density, i, boundary.size(), raster.size());
+  }
+  ok &= check_outlines(regions, nsize);
+  ok &= check_local(regions, nsize, boundary);
+
+  t = chrono::steady_clock::now();
+  construct_edges(fc, regions, nsize);
+  double edges = ms_since(t);
+  double rss = resident_mb();
+
+  t = chrono::steady_clock::now();
+  fc.color_fast();
+  double fast = ms_since(t);
+  t = chrono::steady_clock::now();
+  ok &= fc.validate(threads);
+  double validate = ms_since(t);
+
+  partition(fc, regions, nsize, density);
+  construct_edges(fc, regions, nsize);
+  t = chrono::steady_clock::now();
+  fc.color_parallel(threads);
+  double parallel = ms_since(t);
+  ok &= fc.validate(threads);
+
+  printf("%5d %8g %8zu %8zu %9.2f %9.2f %9.2f %10.3f %8.2f %8.2f %8.2f %7.1f %4s\n",
+         nsize, density, regions.size(), boundary.size()/2,
+         walk, scan, edges, 1000*edges/regions.size(),
+         fast, parallel, validate, rss, ok ? "ok" : "FAIL");
+  fflush(stdout);
+  return ok;
+}
+
+// usage: five-color-stress [seed [max-nsize]]
+int main(int argc, char* argv[]) {
+  srand(argc > 1 ? atoi(argv[1]) : 1);
+  int max_nsize = argc > 2 ? atoi(argv[2]) : 10;
+  int threads = default_threads();
+  static const int nsizes[] = {6, 8, 10, 11, 12};
+  static const double densities[] = {0.001, 0.01, 0.05, 0.2};
+
+  printf("%5s %8s %8s %8s %9s %9s %9s %10s %8s %8s %8s %7s %4s\n",
+         "nsize", "density", "regions", "edges", "walk ms", "scan ms",
+         "build ms", "us/region", "fast ms", "par ms", "valid ms", "rss MB", "");
+  bool ok = true;
+  for (size_t i=0; i<sizeof nsizes/sizeof *nsizes && nsizes[i] <= max_nsize; i++)
+    for (size_t j=0; j<sizeof densities/sizeof *densities; j++)
+      ok &= run(nsizes[i], densities[j], threads);
+
+  return ok ? 0 : 1;
+}
@@ -1,7 +1,15 @@
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MAIN
-#include "five-color.cpp"
 #include <boost/test/unit_test.hpp>
+#define private public
+#include "five-color.cpp"
+#undef private
+#include <functional>
+
+typedef five_color::vertex vertex;
+typedef five_color::edge edge;
+typedef five_color::edge_iterator edge_iterator;
+typedef five_color::vertex_stack vertex_stack;
 
 BOOST_AUTO_TEST_CASE(init) {
   vertex v;
@@ -48,3 +56,154 @@ BOOST_AUTO_TEST_CASE(color) {
   fc.color();
   BOOST_CHECK(v1->color != v2->color);
 }
+
+BOOST_AUTO_TEST_CASE(reset) {
+  five_color fc;
+  fc.reserve(3, 6);
+  for (int run=0; run<3; run++) {
+    fc.reset();
+    vertex *v1=fc.create_vertex(), *v2=fc.create_vertex(), *v3=fc.create_vertex();
+    fc.add_edge(v1, v2); fc.add_edge(v1, v3);
+    fc.add_edge(v2, v1); fc.add_edge(v2, v3);
+    fc.add_edge(v3, v1); fc.add_edge(v3, v2);
+    BOOST_CHECK(v1->degree == 2);
+    fc.color();
+    BOOST_CHECK(v1->color != v2->color);
+    BOOST_CHECK(v1->color != v3->color);
+    BOOST_CHECK(v2->color != v3->color);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(stack) {
+  five_color fc;
+  vertex *v1=fc.create_vertex(), *v2=fc.create_vertex(), *v3=fc.create_vertex();
+  vector<vertex_stack::link> links(3);
+  vertex_stack s(links.data());
+  BOOST_CHECK(s.empty());
+  s.push_front(v1);
+  s.push_front(v2);
+  s.push_front(v3);
+  s.erase(v2);
+  BOOST_CHECK(s.front() == v3);
+  s.pop_front();
+  BOOST_CHECK(s.front() == v1);
+  s.pop_front();
+  BOOST_CHECK(s.empty());
+}
+
+BOOST_AUTO_TEST_CASE(color_grid) {
+  // 20x20 grid with alternating diagonals, so inner vertices have
+  // degree 4 or 8
+  const int w = 20;
+  five_color fc;
+  vector<vertex*> v;
+  vector<vector<int> > adj(w*w);
+  for (int i=0; i<w*w; i++)
+    v.push_back(fc.create_vertex());
+  for (int y=0; y<w; y++) {
+    for (int x=0; x<w; x++) {
+      int i = y*w + x;
+      vector<pair<int,int> > links;
+      if (x+1 < w) links.push_back(make_pair(i, i+1));
+      if (y+1 < w) links.push_back(make_pair(i, i+w));
+      if (x+1 < w && y+1 < w)
+        links.push_back((x+y) % 2 ? make_pair(i+1, i+w) : make_pair(i, i+w+1));
+      for (size_t j=0; j<links.size(); j++) {
+        adj[links[j].first].push_back(links[j].second);
+        adj[links[j].second].push_back(links[j].first);
+      }
+    }
+  }
+  for (int i=0; i<w*w; i++)
+    for (size_t j=0; j<adj[i].size(); j++)
+      fc.add_edge(v[i], v[adj[i][j]]);
+  fc.color();
+  for (int i=0; i<w*w; i++) {
+    BOOST_CHECK(v[i]->color >= 0 && v[i]->color < 5);
+    for (size_t j=0; j<adj[i].size(); j++)
+      BOOST_CHECK(v[i]->color != v[adj[i][j]]->color);
+  }
+}
+
+// Tree on which greedy coloring in creation order needs k+1 colors:
+// the root is created after subtrees whose roots get colors 0..k-1.
+static vertex* greedy_tree(five_color& fc, int k, vector<vector<vertex*> >& adj) {
+  vector<vertex*> kids;
+  for (int i=0; i<k; i++)
+    kids.push_back(greedy_tree(fc, i, adj));
+  vertex* root = fc.create_vertex();
+  adj.resize(root->id+1);
+  for (size_t i=0; i<kids.size(); i++) {
+    adj[root->id].push_back(kids[i]);
+    adj[kids[i]->id].push_back(root);
+  }
+  return root;
+}
+
+BOOST_AUTO_TEST_CASE(color_fast) {
+  five_color fc;
+  vector<vector<vertex*> > adj;
+  greedy_tree(fc, 5, adj);
+  vertex *t1=fc.create_vertex(), *t2=fc.create_vertex(), *t3=fc.create_vertex();
+  adj.resize(t3->id+1);
+  adj[t1->id].push_back(t2); adj[t1->id].push_back(t3);
+  adj[t2->id].push_back(t1); adj[t2->id].push_back(t3);
+  adj[t3->id].push_back(t1); adj[t3->id].push_back(t2);
+  for (size_t i=0; i<adj.size(); i++)
+    for (size_t j=0; j<adj[i].size(); j++)
+      fc.add_edge(fc.vertices[i], adj[i][j]);
+
+  fc.color_fast();
+  BOOST_CHECK(fc.validate());
+  // the triangle is its own component and keeps its greedy colors
+  BOOST_CHECK(t1->color == 0 && t2->color == 1 && t3->color == 2);
+}
+
+BOOST_AUTO_TEST_CASE(color_parallel) {
+  for (int threads=1; threads<=8; threads*=2) {
+    five_color fc;
+    vector<vector<vertex*> > adj;
+    for (int i=0; i<20; i++)
+      greedy_tree(fc, 6, adj);
+    for (size_t i=0; i<adj.size(); i++)
+      for (size_t j=0; j<adj[i].size(); j++)
+        fc.add_edge(fc.vertices[i], adj[i][j]);
+
+    fc.color_parallel(threads);
+    BOOST_CHECK(fc.validate(threads));
+    // one per core, as for color_parallel
+    BOOST_CHECK(fc.validate(0));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(kempe_swap) {
+  // a wheel whose hub sees all five colors; the 0/1 chain from the
+  // first spoke runs straight into the second, so another pair is
+  // needed
+  struct wheel {
+    vector<int> c;
+    vector<vector<int> > adj;
+    size_t size() const { return c.size(); }
+    int color(int v) const { return c[v]; }
+    void set_color(int v, int col) { c[v] = col; }
+    void neighbours(int v, std::function<void(int)> f) const {
+      for (size_t i=0; i<adj[v].size(); i++)
+        f(adj[v][i]);
+    }
+  } g;
+  int colors[] = {5, 0, 1, 2, 3, 4};
+  g.c.assign(colors, colors+6);
+  g.adj.resize(6);
+  for (int i=1; i<=5; i++) {
+    int j = i % 5 + 1;
+    g.adj[0].push_back(i); g.adj[i].push_back(0);
+    g.adj[i].push_back(j); g.adj[j].push_back(i);
+  }
+
+  kempe k;
+  BOOST_CHECK(k.recolor(g, 0));
+  BOOST_CHECK(g.c[0] < 5);
+  for (int v=0; v<6; v++)
+    for (size_t i=0; i<g.adj[v].size(); i++)
+      BOOST_CHECK(g.c[v] != g.c[g.adj[v][i]]);
+}
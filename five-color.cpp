@@ -19,12 +19,11 @@
  */
 
 #include "five-color.h"
+#include "parallel.h"
 
 using namespace std;
-using namespace boost;
 
 #include <stdio.h>
-#include <stack>
 #include <assert.h>
 
 struct five_color::edge_iterator {
@@ -66,19 +65,18 @@ void five_color::edge::identify(edge* other) {
 five_color::vertex::vertex()
   : root_edge(0),
     degree(0),
+    id(-1),
     type(s_none),
     color(0),
     mark(false)
 {
 }
 
-void five_color::vertex::add_edge(five_color::vertex* other,
-                                  boost::object_pool<five_color::edge>& pool)
-{
-  if (edge_map.find(other) != edge_map.end())
+void five_color::vertex::add_edge(five_color::vertex* other, five_color& fc) {
+  if (fc.edges.find(this, other))
     return;
   
-  edge* e = pool.construct();
+  edge* e = fc.edge_pool.construct();
   e->vtx = other;
   if (root_edge) {
     e->prev = root_edge;
@@ -87,10 +85,10 @@ void five_color::vertex::add_edge(five_color::vertex* other,
     root_edge->next = e;
     root_edge = e;
   } else root_edge = e->next = e->prev = e;
-  edge_map.insert(pair<vertex*,edge*>(other, e));
+  fc.edges.insert(this, other, e);
 
-  if (!other->edge_map.empty()) {
-    e->pos = other->edge_map[this];
+  if (other->root_edge) {
+    e->pos = fc.edges.find(other, this);
     assert(e->pos);
     e->pos->pos = e;
   }
@@ -158,10 +156,10 @@ five_color::edge* five_color::vertex::find_min_edge() {
 void five_color::vertex::remove_from_stack(vertex_stack* s4, vertex_stack* s5) {
   switch (type) {
   case s_4t:
-    s4->erase(stack_pos);
+    s4->erase(this);
     break;
   case s_5t:
-    s5->erase(stack_pos);
+    s5->erase(this);
   }
 
   type = s_none;
@@ -234,28 +232,326 @@ void five_color::vertex::push_to(vertex_stack* s4, vertex_stack* s5) {
   }
 
   cur_stack->push_front(this);
-  stack_pos = cur_stack->begin();
+}
+
+//// vertex_stack //////////////////////////////////////////////////////////////
+
+void five_color::vertex_stack::push_front(vertex* v) {
+  link& l = links[v->id];
+  l.prev = 0;
+  l.next = head;
+  if (head)
+    links[head->id].prev = v;
+  head = v;
+}
+
+void five_color::vertex_stack::erase(vertex* v) {
+  link& l = links[v->id];
+  if (l.prev)
+    links[l.prev->id].next = l.next;
+  else
+    head = l.next;
+  if (l.next)
+    links[l.next->id].prev = l.prev;
+}
+
+//// edge_table ////////////////////////////////////////////////////////////////
+
+five_color::edge* five_color::edge_table::find(const vertex* from,
+                                               const vertex* to) const
+{
+  if (slots.empty())
+    return 0;
+
+  size_t mask = slots.size()-1;
+  for (size_t i=home(from);; i = (i+1) & mask) {
+    const slot& s = slots[i];
+    if (s.generation != generation)
+      return 0;
+    if (s.from == from && s.to == to)
+      return s.e;
+  }
+}
+
+void five_color::edge_table::insert(const vertex* from, const vertex* to, edge* e) {
+  reserve(count+1, max(vertices, (size_t)from->id+1));
+  size_t mask = slots.size()-1;
+  size_t i = home(from);
+  while (slots[i].generation == generation)
+    i = (i+1) & mask;
+  slot s = {from, to, e, generation};
+  slots[i] = s;
+  count++;
+}
+
+void five_color::edge_table::reserve(size_t n, size_t nvertices) {
+  vertices = max(nvertices, (size_t)1);
+  // keep the load factor at or below 1/2
+  if (2*n <= slots.size())
+    return;
+
+  size_t size = 64;
+  while (size < 2*n)
+    size *= 2;
+  // odd, so ids past the estimate still land on distinct homes
+  spread = size/vertices | 1;
+
+  vector<slot> old(size);
+  old.swap(slots);
+  unsigned old_generation = generation;
+  for (size_t i=0; i<slots.size(); i++)
+    slots[i].generation = 0;
+  generation = 1;
+  count = 0;
+  for (size_t i=0; i<old.size(); i++) {
+    if (old[i].generation == old_generation)
+      insert(old[i].from, old[i].to, old[i].e);
+  }
+}
+
+void five_color::edge_table::clear() {
+  count = 0;
+  if (++generation == 0) {
+    for (size_t i=0; i<slots.size(); i++)
+      slots[i].generation = 0;
+    generation = 1;
+  }
 }
 
 //// public api ////////////////////////////////////////////////////////////////
 
 five_color::vertex* five_color::create_vertex() {
   vertex* v = vertex_pool.construct();
+  v->id = vertices.size();
   vertices.push_back(v);
   return v;
 }
 
 void five_color::add_edge(vertex* from, vertex* to) {
-  from->add_edge(to, edge_pool);
+  from->add_edge(to, *this);
+}
+
+void five_color::reserve(size_t nvertices, size_t nedges) {
+  vertex_pool.reserve(nvertices);
+  edge_pool.reserve(nedges);
+  edges.reserve(nedges, nvertices);
+  vertices.reserve(nvertices);
+  stack_links.reserve(nvertices);
+  reductions.reserve(2*nvertices);
+}
+
+void five_color::reset() {
+  vertex_pool.reset();
+  edge_pool.reset();
+  edges.clear();
+  vertices.clear();
 }
 
 void five_color::color() {
-  five_color::vertex::vertex_stack s4, s5;
-  stack<pair<vertex*, vertex*> > sd;
+  build_adjacency();
+  contract(vertices);
+}
+
+void five_color::color_fast() {
+  build_adjacency();
+
+  // Earlier neighbours are already colored and later ones are not, so
+  // only the former go into the mask.  A vertex that sees all five
+  // colors is left at 5 for repair().
+  colors.resize(vertices.size());
+  for (int i=0; i<(int)vertices.size(); i++) {
+    int used = 0;
+    for (int j=adj_offsets[i]; j<adj_offsets[i+1]; j++) {
+      if (adj[j] < i)
+        used |= 1 << colors[adj[j]];
+    }
+    int c = 0;
+    while (c < 5 && used & 1<<c)
+      c++;
+    colors[i] = c;
+  }
+
+  repair();
+}
+
+static inline uint32_t priority(uint32_t v) {
+  v ^= v >> 16;
+  v *= 0x85ebca6b;
+  v ^= v >> 13;
+  v *= 0xc2b2ae35;
+  v ^= v >> 16;
+  return v;
+}
+
+void five_color::color_parallel(int threads) {
+  build_adjacency();
+
+  int n = vertices.size();
+  if (threads <= 0)
+    threads = default_threads();
+  threads = max(1, min(threads, n));
+
+  colors.assign(n, -1);
+  selected.assign(n, 0);
+  vector<size_t> remaining(2*threads);
+  thread_barrier sync(threads);
+
+  // Each round colors the uncolored vertices whose priority beats all
+  // their uncolored neighbours.  Those form an independent set, so
+  // the selection and coloring phases only ever write their own
+  // vertices.
+  parallel_for(threads, n, [&](int t, size_t begin, size_t end) {
+      vector<int> mine;
+      for (size_t v=begin; v<end; v++)
+        mine.push_back(v);
+
+      for (int round=0;; round++) {
+        for (size_t k=0; k<mine.size(); k++) {
+          int v = mine[k];
+          uint32_t p = priority(v);
+          bool max = true;
+          for (int j=adj_offsets[v]; max && j<adj_offsets[v+1]; j++) {
+            int u = adj[j];
+            uint32_t q = priority(u);
+            if (colors[u] < 0 && (q > p || (q == p && u > v)))
+              max = false;
+          }
+          selected[v] = max;
+        }
+        sync.wait();
+
+        size_t left = 0;
+        for (size_t k=0; k<mine.size(); k++) {
+          int v = mine[k];
+          if (!selected[v]) {
+            mine[left++] = v;
+            continue;
+          }
+          uint64_t used = 0;
+          for (int j=adj_offsets[v]; j<adj_offsets[v+1]; j++) {
+            int c = colors[adj[j]];
+            if (c >= 0 && c < 64)
+              used |= (uint64_t)1 << c;
+          }
+          int c = ~used ? __builtin_ctzll(~used) : 64;
+          // every color below 64 taken: look further the slow way
+          for (bool taken = c == 64; taken; c += taken) {
+            taken = false;
+            for (int j=adj_offsets[v]; !taken && j<adj_offsets[v+1]; j++)
+              taken = colors[adj[j]] == c;
+          }
+          colors[v] = c;
+        }
+        mine.resize(left);
+        remaining[2*t + (round&1)] = left;
+        sync.wait();
+
+        size_t total = 0;
+        for (int i=0; i<threads; i++)
+          total += remaining[2*i + (round&1)];
+        if (!total)
+          break;
+      }
+    });
+
+  repair();
+}
+
+bool five_color::validate(int threads) const {
+  if (threads <= 0)
+    threads = default_threads();
+  vector<char> ok(threads, true);
+  parallel_for(threads, vertices.size(), [&](int t, size_t begin, size_t end) {
+      for (size_t i=begin; ok[t] && i<end; i++) {
+        int c = vertices[i]->color;
+        if (c < 0 || c >= 5)
+          ok[t] = false;
+        for (int j=adj_offsets[i]; j<adj_offsets[i+1]; j++) {
+          if (vertices[adj[j]]->color == c)
+            ok[t] = false;
+        }
+      }
+    });
+  return find(ok.begin(), ok.end(), false) == ok.end();
+}
+
+struct five_color::csr_graph {
+  five_color& fc;
+
+  size_t size() const { return fc.vertices.size(); }
+  int color(int v) const { return fc.colors[v]; }
+  void set_color(int v, int c) { fc.colors[v] = c; }
+
+  template <class F>
+  void neighbours(int v, F f) const {
+    for (int j=fc.adj_offsets[v]; j<fc.adj_offsets[v+1]; j++)
+      f(fc.adj[j]);
+  }
+};
+
+// Bring colors down to the palette and store them in the vertices.
+// Kempe interchanges handle almost everything; components that still
+// hold an out-of-palette vertex get the contraction instead.
+void five_color::repair() {
+  csr_graph g = {*this};
+  bool failed = false;
+  for (size_t i=0; i<vertices.size(); i++) {
+    if (colors[i] >= 5 && !chains.recolor(g, i))
+      failed = true;
+  }
+
+  for (size_t i=0; i<vertices.size(); i++)
+    vertices[i]->color = min(colors[i], 5);
+
+  if (!failed)
+    return;
+
+  visited.assign(vertices.size(), false);
+  for (int i=0; i<(int)vertices.size(); i++) {
+    if (vertices[i]->color < 5 || visited[i])
+      continue;
+
+    component.clear();
+    component.push_back(vertices[i]);
+    visited[i] = true;
+    for (size_t k=0; k<component.size(); k++) {
+      int v = component[k]->id;
+      component[k]->color = 0;
+      for (int j=adj_offsets[v]; j<adj_offsets[v+1]; j++) {
+        if (!visited[adj[j]]) {
+          visited[adj[j]] = true;
+          component.push_back(vertices[adj[j]]);
+        }
+      }
+    }
+    contract(component);
+  }
+}
+
+void five_color::build_adjacency() {
+  adj_offsets.resize(vertices.size()+1);
+  adj.clear();
+  for (size_t i=0; i<vertices.size(); i++) {
+    adj_offsets[i] = adj.size();
+    foreach_edge(edg, vertices[i])
+      adj.push_back(edg->vtx->id);
+  }
+  adj_offsets[vertices.size()] = adj.size();
+}
+
+void five_color::contract(const vector<vertex*>& vs) {
+  // Everything the reduction touches is sized up front: at most one
+  // undo entry per removed vertex plus one per identified pair.  Links
+  // are written on push, so they need no clearing between runs.
+  if (stack_links.size() < vertices.size())
+    stack_links.resize(vertices.size());
+  reductions.clear();
+  reductions.reserve(2*vs.size());
+  vertex_stack s4(stack_links.data()), s5(stack_links.data());
 
-  // printf("size: %d\n", vertices.size());
+  // printf("size: %d\n", vs.size());
 
-  for (vector<vertex*>::iterator v=vertices.begin(); v != vertices.end(); ++v)
+  for (vector<vertex*>::const_iterator v=vs.begin(); v != vs.end(); ++v)
     (**v).push_to(&s4,&s5);
 
   for (;;) {
@@ -264,7 +560,7 @@ void five_color::color() {
       // printf("\n== pop s4 %p %d ==\n", v, v->degree);
       s4.pop_front();
       v->remove();
-      sd.push(pair<vertex*,vertex*>(v,0));
+      reductions.push_back(reduction(v,0));
       // degree has decreased by one
       foreach_edge(edg, v) {
         // printf("s4 edge %p\n", edg->vtx);
@@ -280,7 +576,7 @@ void five_color::color() {
     vertex* v = s5.front();
     s5.pop_front();
     v->remove();
-    sd.push(pair<vertex*,vertex*>(v,0));
+    reductions.push_back(reduction(v,0));
     edge *v1=v->find_min_edge(), *v2=v1->next, *v3=v2->next, *v4=v3->next, *a, *b;
     if (v1->vtx->adjacent_to(v3->vtx)) {
       a = v1; b = v3;
@@ -294,13 +590,13 @@ void five_color::color() {
     foreach_edge(edg, v) {
       edg->vtx->push_to(&s4,&s5);
     }
-    sd.push(pair<vertex*,vertex*>(a->vtx,b->vtx));
+    reductions.push_back(reduction(a->vtx,b->vtx));
   }
 
-  while (!sd.empty()) {
-    pair<vertex*,vertex*> v(sd.top());
+  while (!reductions.empty()) {
+    reduction v(reductions.back());
     // printf("color %p\n", v.first);
-    sd.pop();
+    reductions.pop_back();
     if (v.second)
       v.first->color = v.second->color;
     else
@@ -21,15 +21,45 @@
 #ifndef FIVE_COLOR_H
 #define FIVE_COLOR_H
 
-#include <list>
 #include <vector>
-#include <boost/pool/object_pool.hpp>
-#include <unordered_map>
+#include <memory>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <algorithm>
+
+// Kempe-chain recoloring into the palette [0,5).  Graph provides
+//
+//   size_t size() const; // vertex ids so far; walking may add more
+//   int color(int v) const;
+//   void set_color(int v, int c);
+//   template <class F> void neighbours(int v, F f) const; // f(u) each
+//
+// recolor() gives v a palette color, interchanging the two colors of
+// a chain around v if all five are taken.  On a planar graph it cannot
+// fail for a vertex of degree five or less.
+class kempe {
+public:
+  kempe() : stamp(0) {}
+  template <class Graph> bool recolor(Graph& g, int v);
+
+private:
+  std::vector<unsigned> seen; // grown as higher ids turn up
+  std::vector<int> chain;
+  unsigned stamp;
+
+  unsigned& seen_at(int v) {
+    if ((size_t)v >= seen.size())
+      seen.resize(std::max(2*seen.size(), (size_t)v+1), 0);
+    return seen[v];
+  }
+};
 
 class five_color {
 private:
-  class edge;
+  struct edge;
   struct edge_iterator;
+  class vertex_stack;
 
 public:
   class vertex {
@@ -39,21 +69,20 @@ public:
     vertex();
     
   private:
-    typedef std::list<vertex*> vertex_stack;
     enum vertex_type {s_none, s_4t, s_5t};
 
-    friend class edge;
-    friend class edge_iterator;
+    friend struct edge;
+    friend struct edge_iterator;
     friend class five_color;
+    friend class vertex_stack;
 
     edge* root_edge;
     int degree;
+    int id; // position in five_color::vertices
     vertex_type type;
-    vertex_stack::iterator stack_pos;
     bool mark;
-    std::unordered_map<vertex*,edge*> edge_map;
 
-    void add_edge(vertex* other, boost::object_pool<edge>& pool);
+    void add_edge(vertex* other, five_color& fc);
     void remove();
     bool adjacent_to(vertex* other);
     void assign_color();
@@ -69,24 +98,239 @@ public:
   vertex* create_vertex();
   void add_edge(vertex* from, vertex* to);
   void color();
+  // Greedy coloring in creation order (Hilbert order for a region
+  // map), falling back to color()'s contraction only on components
+  // where five colors did not suffice.
+  void color_fast();
+  // Jones-Plassmann coloring on the given number of threads (0 for
+  // one per core), brought down to five colors by Kempe interchanges.
+  // Anything those cannot fix falls back to the contraction as in
+  // color_fast().
+  void color_parallel(int threads = 0);
+  // Check the last coloring against the graph as it was before
+  // coloring.
+  bool validate(int threads = 1) const;
+
+  // Preallocate for a graph of the given size; edges counts each
+  // direction separately.
+  void reserve(size_t vertices, size_t edges);
+  // Forget the current graph, keeping all storage for the next one.
+  // Vertices handed out before the reset are invalidated.
+  void reset();
 
 private:
-  class edge {
+  struct edge {
     vertex* vtx;
     edge* pos;
     edge* prev;
     edge* next;
 
-    friend class vertex;
-    friend class five_color;
-
     void remove();
     void identify(edge* other);
   };
 
-  boost::object_pool<edge> edge_pool;
-  boost::object_pool<vertex> vertex_pool;
+  // Intrusive stack threaded through a link array indexed by vertex
+  // id.  s4 and s5 share the same links since a vertex is on at most
+  // one of them at a time (see vertex::type).
+  class vertex_stack {
+  public:
+    struct link {
+      vertex* prev;
+      vertex* next;
+    };
+
+    vertex_stack(link* links) : links(links), head(0) {}
+
+    bool empty() const { return !head; }
+    vertex* front() const { return head; }
+    void push_front(vertex* v);
+    void erase(vertex* v);
+    void pop_front() { erase(head); }
+
+  private:
+    link* links;
+    vertex* head;
+  };
+
+  // Block allocator whose blocks survive reset(), so a reused
+  // five_color neither mallocs nor faults in fresh pages.
+  template <class T>
+  class pool {
+  public:
+    pool() : used(0) {}
+
+    T* construct() {
+      reserve(used+1);
+      T* t = &blocks[used/block_size][used%block_size];
+      used++;
+      *t = T();
+      return t;
+    }
+
+    void reserve(size_t n) {
+      while (blocks.size()*block_size < n)
+        blocks.push_back(std::unique_ptr<T[]>(new T[block_size]));
+    }
+
+    void reset() { used = 0; }
+
+  private:
+    enum { block_size = 1024 };
+    std::vector<std::unique_ptr<T[]> > blocks;
+    size_t used;
+  };
+
+  // Open-addressed (from, to) -> edge map used to dedupe edges and to
+  // pair each edge with its reverse.  Slots are tagged with a
+  // generation so clear() is constant time.
+  class edge_table {
+  public:
+    edge_table() : count(0), generation(1), vertices(1), spread(1) {}
+
+    edge* find(const vertex* from, const vertex* to) const;
+    void insert(const vertex* from, const vertex* to, edge* e);
+    void reserve(size_t edges, size_t vertices);
+    void clear();
+
+  private:
+    struct slot {
+      const vertex* from;
+      const vertex* to;
+      edge* e;
+      unsigned generation;
+    };
+
+    std::vector<slot> slots;
+    size_t count;
+    unsigned generation;
+    size_t vertices;
+    size_t spread;
+
+    // Lay vertices out in id order rather than hashing them, so a
+    // vertex's edges share a probe run and the reverse edges looked up
+    // while adding them sit close by.
+    size_t home(const vertex* from) const {
+      return from->id*spread & (slots.size()-1);
+    }
+  };
+
+  typedef std::pair<vertex*,vertex*> reduction;
+
+  pool<edge> edge_pool;
+  pool<vertex> vertex_pool;
+  edge_table edges;
   std::vector<vertex*> vertices;
+  std::vector<vertex_stack::link> stack_links;
+  std::vector<reduction> reductions;
+
+  // CSR snapshot of the graph by vertex id, taken before coloring
+  // since the contraction dismantles the edge rings
+  std::vector<int> adj_offsets;
+  std::vector<int> adj;
+  std::vector<vertex*> component;
+  std::vector<bool> visited;
+
+  // working colors by id; may exceed the palette before repair()
+  std::vector<int> colors;
+  std::vector<char> selected;
+  kempe chains;
+
+  struct csr_graph;
+
+  void build_adjacency();
+  void contract(const std::vector<vertex*>& vs);
+  void repair();
 };
 
+template <class Graph>
+bool kempe::recolor(Graph& g, int v) {
+  int used = 0;
+  g.neighbours(v, [&](int u) {
+      int c = g.color(u);
+      if (c >= 0 && c < 5)
+        used |= 1 << c;
+    });
+  for (int c=0; c<5; c++) {
+    if (!(used & 1<<c)) {
+      g.set_color(v, c);
+      return true;
+    }
+  }
+
+  if (seen.size() < g.size())
+    seen.resize(g.size(), 0);
+
+  // Grow the a/b chains through v's a-colored neighbours.  If none of
+  // them reaches a b-colored neighbour, swapping a and b along them
+  // frees a for v.  Growth stops at limit vertices, setting cut, so
+  // that of the pairs that work, the one with the shortest chains is
+  // found for little more than it costs to swap.
+  bool cut = false;
+  auto grow = [&](int a, int b, size_t limit) {
+    if (stamp > UINT_MAX-2) {
+      std::fill(seen.begin(), seen.end(), 0);
+      stamp = 0;
+    }
+    unsigned visit = ++stamp, target = ++stamp;
+
+    chain.clear();
+    g.neighbours(v, [&](int u) {
+        int c = g.color(u);
+        if (c == a && seen_at(u) != visit) {
+          seen_at(u) = visit;
+          chain.push_back(u);
+        } else if (c == b) {
+          seen_at(u) = target;
+        }
+      });
+
+    bool blocked = false;
+    for (size_t i=0; i<chain.size() && !blocked; i++) {
+      g.neighbours(chain[i], [&](int u) {
+          int c = g.color(u);
+          if (u == v || blocked || (c != a && c != b))
+            return;
+          unsigned& s = seen_at(u);
+          if (s == target) {
+            blocked = true;
+          } else if (s != visit) {
+            s = visit;
+            chain.push_back(u);
+          }
+        });
+      if (!blocked && chain.size() >= limit) {
+        blocked = true;
+        cut = true;
+      }
+    }
+    return !blocked;
+  };
+
+  // Try every pair with short limits first, raising them only while
+  // some chain was cut short, so that one long chain is never grown
+  // in full where a short one would do
+  int best_a = -1, best_b = -1;
+  for (size_t limit=16; best_a < 0; limit = limit > SIZE_MAX/4 ? SIZE_MAX : 4*limit) {
+    cut = false;
+    size_t best = limit;
+    for (int a=0; a<5; a++) {
+      for (int b=0; b<5; b++) {
+        if (a == b || !grow(a, b, best))
+          continue;
+        best = chain.size();
+        best_a = a;
+        best_b = b;
+      }
+    }
+    if (best_a < 0 && !cut)
+      return false;
+  }
+
+  grow(best_a, best_b, SIZE_MAX);
+  for (size_t i=0; i<chain.size(); i++)
+    g.set_color(chain[i], g.color(chain[i]) == best_a ? best_b : best_a);
+  g.set_color(v, best_a);
+  return true;
+}
+
 #endif //FIVE_COLOR_H
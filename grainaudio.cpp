@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <iostream>
 #include <sstream>
+#include <algorithm>
 
 #define CHK(stmt) if(!(stmt)) {puts("ERROR: "#stmt); exit(1);}
 
@@ -46,7 +47,7 @@ static void step_toward(float& x0, float& y0, float x1, float y1) {
 }
 
 struct audio_region {
-  int start, end;
+  int64_t start, end;
 };
 
 template <class T>
@@ -73,19 +74,39 @@ T* atomic_assign<T>::read() {
 static int process(jack_nframes_t nframes, void *arg);
 static void jack_shutdown(void* arg);
 
-grainaudio::grainaudio(grainmap& gm)
-  : gm(gm),
-    audio(gm.get_audio()),
-    x0(0), y0(0), x1(50), y1(50),
-    start(-1), end(-1), starti(-1), endi(-1),
-    cur_sample(-1),
+grainaudio::grainaudio(const shared_ptr<grainmap>& gm)
+  : port_count(0),
+    next_map(0),
+    playing(gm.get()),
+    held(1, gm),
     cur_dir(1),
     counter(0)
 {
+  use_map(gm.get());
+  x1 = y1 = 50;
+  output_ports.reserve(max_ports);
   CHK(client=jack_client_open("grainaudio", JackNullOption, 0));
   jack_set_process_callback(client, ::process, this);
   jack_on_shutdown(client, jack_shutdown, 0);
-  for (int i=0; i<gm.channel_count(); i++) {
+  CHK(!jack_activate(client));
+  add_ports(gm->channel_count());
+}
+
+grainaudio::~grainaudio() {
+  jack_deactivate(client);
+}
+
+// Register output ports up to count and connect each new one to the
+// matching physical playback port, if there is one
+void grainaudio::add_ports(int count) {
+  count = min(count, max_ports);
+  if (count <= port_count) return;
+
+  const char** physical = jack_get_ports(client, NULL, NULL, JackPortIsPhysical|JackPortIsInput);
+  int available = 0;
+  while (physical && physical[available])
+    available++;
+  for (int i=output_ports.size(); i<count; i++) {
     ostringstream port_name;
     port_name << "out " << i;
     out_port p = {jack_port_register(client,
@@ -93,21 +114,44 @@ grainaudio::grainaudio(grainmap& gm)
                                      JACK_DEFAULT_AUDIO_TYPE,
                                      JackPortIsOutput | JackPortIsTerminal,
                                      0)};
+    CHK(p.port);
     output_ports.push_back(p);
+    if (i < available)
+      CHK(!jack_connect(client, jack_port_name(p.port), physical[i]));
   }
+  if (physical)
+    jack_free(physical);
+  port_count = count;
+}
 
-  CHK(!jack_activate(client));
-
-  const char **ports;
+void grainaudio::set_map(const shared_ptr<grainmap>& map) {
+  add_ports(map->channel_count());
+  held.push_back(map);
+  next_map = map.get();
+}
 
-  CHK(ports = jack_get_ports(client, NULL, NULL, JackPortIsPhysical|JackPortIsInput));
-  for (auto it = output_ports.begin(); ports && it != output_ports.end(); ++it) {
-    CHK(!jack_connect(client, jack_port_name(it->port), *ports++));
+void grainaudio::release_maps() {
+  // process() only ever moves on to the newest map set, so everything
+  // held before the one playing is free
+  grainmap* now = playing;
+  for (size_t i=1; i<held.size(); i++) {
+    if (held[i].get() == now) {
+      held.erase(held.begin(), held.begin() + i);
+      break;
+    }
   }
 }
 
-grainaudio::~grainaudio() {
-  jack_deactivate(client);
+// Start over on map: silent until the next set_point()
+void grainaudio::use_map(grainmap* map) {
+  gm = map;
+  audio = map->get_audio();
+  channels = map->channel_count();
+  x0 = y0 = x1 = y1 = 0;
+  start = end = starti = endi = -1;
+  edits = map->edits();
+  stale = false;
+  cur_sample = -1;
 }
 
 void grainaudio::set_point(float x, float y) {
@@ -116,14 +160,30 @@ void grainaudio::set_point(float x, float y) {
   cur_point.write(new_point);
 }
 
+bool grainaudio::read_playhead(playhead& p) {
+  playhead* next = cur_playhead.read();
+  if (!next) return false;
+  p = *next;
+  return true;
+}
+
 void grainaudio::process(jack_nframes_t nframes) {
+  grainmap* map = next_map.exchange(0);
+  if (map) {
+    // a point still pending was meant for the previous map
+    cur_point.read();
+    use_map(map);
+    playing = map;
+  }
+
   point* next_point = cur_point.read();
   if (next_point) {
     x1 = next_point->x;
     y1 = next_point->y;
   }
 
-  for (int chan=0; chan<output_ports.size(); chan++) {
+  const int ports = port_count;
+  for (int chan=0; chan<ports; chan++) {
     output_ports[chan].buffer =
       (jack_default_audio_sample_t*)
       jack_port_get_buffer(output_ports[chan].port, nframes);
@@ -132,11 +192,14 @@ void grainaudio::process(jack_nframes_t nframes) {
   for (int i=0; i<nframes; i++) {
     if (counter-- <= 0) {
       counter = 10;
-      if (x0 != x1 || y0 != y1) {
+      // the map may have been re-segmented under the current region;
+      // while that is under way, keep playing the old one
+      if (x0 != x1 || y0 != y1 || stale ||
+          (start != -1 && edits != gm->edits())) {
         //puts("grabbing");
         step_toward(x0,y0,x1,y1);
-        gm.lookup(x0, y0, start, end, starti, endi);
-        if (cur_sample < start || cur_sample >= end) {
+        stale = !gm->try_lookup(x0, y0, start, end, starti, endi, edits);
+        if (!stale && (cur_sample < start || cur_sample >= end)) {
           //puts("new thing");
           // cross fade
           cur_sample = start;
@@ -145,9 +208,9 @@ void grainaudio::process(jack_nframes_t nframes) {
       }
     }
 
-    for (int chan=0; chan<output_ports.size(); chan++) {
+    for (int chan=0; chan<ports; chan++) {
       output_ports[chan].buffer[i] =
-        start == -1 ? 0 : audio[chan][cur_sample];
+        start == -1 || chan >= channels ? 0 : audio[chan][cur_sample];
     }
 
     cur_sample += cur_dir;
@@ -159,6 +222,13 @@ void grainaudio::process(jack_nframes_t nframes) {
       cur_dir = 1;
     }
   }
+
+  playhead ph = {gm, -1, -1};
+  if (start != -1) {
+    ph.starti = starti;
+    ph.index = gm->sample_index(cur_sample, start, end, starti, endi);
+  }
+  cur_playhead.write(ph);
 }
 
 static int process(jack_nframes_t nframes, void *arg) {
@@ -23,6 +23,7 @@
 
 #include <jack/jack.h>
 #include <atomic>
+#include <memory>
 #include <vector>
 #include "grainmap.h"
 
@@ -30,6 +31,13 @@ struct point {
   float x, y;
 };
 
+// what the audio thread is playing: the map, the Hilbert index of its
+// region's start, or -1 when silent, and of the current sample
+struct playhead {
+  const grainmap* map;
+  int64_t starti, index;
+};
+
 // TODO clean up (maybe add another T)
 template <class T>
 struct atomic_assign {
@@ -47,23 +55,50 @@ class grainaudio {
     jack_port_t* port;
     jack_default_audio_sample_t* buffer;
   };
+  // ports are only ever added, and the vector never reallocates, so
+  // the process thread can read the first port_count while more are
+  // registered
+  static const int max_ports = 64;
   std::vector<out_port> output_ports;
+  std::atomic<int> port_count;
   atomic_assign<point> cur_point;
-  grainmap& gm;
+  atomic_assign<playhead> cur_playhead;
+  // set_map() hands a map over through next_map; process() takes it
+  // and acknowledges through playing.  held keeps every map handed
+  // over, oldest first, until release_maps() sees a later one playing.
+  std::atomic<grainmap*> next_map;
+  std::atomic<grainmap*> playing;
+  std::vector<std::shared_ptr<grainmap> > held;
+  grainmap* gm;
   float** audio;
+  int channels;
 
   float x0, y0, x1, y1;
-  int start, end, starti, endi;
-  int cur_sample;
+  int64_t start, end, starti, endi;
+  unsigned edits; // gm->edits() when the region was looked up
+  bool stale;     // a lookup found the map being edited
+  int64_t cur_sample;
   int cur_dir;
   int counter;
 
   jack_client_t* client;
 
+  void add_ports(int count);
+  void use_map(grainmap* map);
+
 public:
-  grainaudio(grainmap& gm);
+  grainaudio(const std::shared_ptr<grainmap>& gm);
   ~grainaudio();
+  // Play from gm instead, keeping the JACK client and its connections.
+  // Returns at once; the previous map is kept until the process thread
+  // has moved on from it.
+  void set_map(const std::shared_ptr<grainmap>& gm);
+  // Drop maps the process thread is done with.  Call now and then from
+  // the thread that calls set_map().
+  void release_maps();
   void set_point(float x, float y);
+  // false if nothing was published since the last call
+  bool read_playhead(playhead& p);
   void process(jack_nframes_t nframes);
 };
 
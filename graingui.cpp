@@ -22,50 +22,526 @@
 #include <cairomm/cairomm.h>
 #include <grainmap.h>
 #include <grainaudio.h>
+#include <tiles.h>
+#include <library.h>
 #include <memory>
 #include <assert.h>
-#include <thread>
 #include <unistd.h>
+#include <math.h>
 
 using namespace std;
 using namespace Gtk;
 using namespace Cairo;
 
+// set from the command line
+static map_options command_options;
+
+static map_options tiled_options() {
+  map_options options = command_options;
+  options.draw_image = false;
+  options.cache_dir = default_cache_dir();
+  return options;
+}
+
+static bool choose_file(string& path) {
+  FileChooserDialog dialog("Choose an audio sample to load", FILE_CHOOSER_ACTION_OPEN);
+  dialog.add_button(Gtk::Stock::CANCEL, Gtk::RESPONSE_CANCEL);
+  dialog.add_button("Select", RESPONSE_OK);
+  if (dialog.run() != RESPONSE_OK)
+    return false;
+  dialog.hide();
+  path = dialog.get_filename();
+  return true;
+}
+
+// path's map from library, loading it on a worker thread behind a
+// dialog showing its progress if it is not resident; null if the user
+// cancelled or, after saying why, if it could not be loaded
+static shared_ptr<grainmap> load_map(map_library& library, const string& path) {
+  shared_ptr<grainmap> map = library.find(path);
+  if (map)
+    return map;
+
+  Dialog progress("Loading " + path);
+  ProgressBar bar;
+  progress.set_resizable(false);
+  progress.get_vbox()->pack_end(bar, PACK_SHRINK);
+  progress.add_button(Gtk::Stock::CANCEL, RESPONSE_CANCEL);
+  progress.show_all();
+
+  Glib::Dispatcher finished;
+  finished.connect([&]() { progress.response(RESPONSE_OK); });
+  int response;
+  string error;
+  {
+    grainmap_loader loader([&](load_progress& p) {
+                             return library.get(path, &p);
+                           },
+                           [&](shared_ptr<grainmap> loaded, const string& why) {
+                             map = loaded;
+                             error = why;
+                             finished.emit();
+                           });
+    sigc::connection tick = Glib::signal_timeout().connect([&]() {
+        bar.set_fraction(loader.fraction());
+        return true;
+      }, 100);
+    response = progress.run();
+    tick.disconnect();
+    // the loader's destructor cancels it if it is still going and
+    // waits for its thread
+  }
+  if (response != RESPONSE_OK)
+    map.reset();
+  if (!map && !error.empty()) {
+    progress.hide();
+    MessageDialog message("Could not load " + path, false, MESSAGE_ERROR);
+    message.set_secondary_text(error);
+    message.run();
+  }
+  return map;
+}
+
 class grain_widget : public DrawingArea {
 private:
-  grainmap gm;
+  map_library& library;
+  vector<string> paths; // the set flipped through with n and p
+  size_t current;
+  shared_ptr<grainmap> gm;
+  unique_ptr<map_tiles> tiles;
   grainaudio audio;
 
+  double zoom;   // screen pixels per map pixel
+  double ox, oy; // map position of the widget's top left corner
+  bool fit;      // keep the whole map in view until the user zooms
+  double pan_x, pan_y;
+  int64_t selected; // start of the region last clicked, or -1
+
+  // The tiles and outlines as they appear at the current zoom and
+  // offset, composed once and then blitted under each expose.  Pans
+  // shift it into back and compose only the strips they uncover.
+  int width, height;
+  RefPtr<ImageSurface> view, back;
+  bool view_valid;
+
+  // transient marks drawn over the view, in map coordinates
+  bool cursor_shown;
+  double cursor_x, cursor_y;
+  static const int cursor_radius = 5;
+  int64_t active;       // start of the region being played, or -1
+  int head_x, head_y;   // pixel under the playhead, if active
+
 public:
-  grain_widget(const string& path) : gm(path), audio(gm) {
+  grain_widget(map_library& library, const vector<string>& paths,
+               shared_ptr<grainmap> map)
+    : library(library),
+      paths(paths),
+      current(0),
+      gm(map),
+      tiles(new_tiles(*gm)),
+      audio(gm),
+      zoom(1), ox(0), oy(0),
+      fit(true),
+      selected(-1),
+      width(0), height(0),
+      view_valid(false),
+      cursor_shown(false),
+      active(-1)
+  {
     add_events(Gdk::BUTTON_PRESS_MASK           |
                Gdk::POINTER_MOTION_MASK         |
-               Gdk::POINTER_MOTION_HINT_MASK);
+               Gdk::POINTER_MOTION_HINT_MASK    |
+               Gdk::SCROLL_MASK                 |
+               Gdk::KEY_PRESS_MASK);
+    set_can_focus(true);
+    Glib::signal_timeout().connect(
+      sigc::mem_fun(*this, &grain_widget::poll_playhead), 16);
+    prefetch_neighbours();
   }
 
-  void set_point(int x, int y) {
-    int start, end;
-    double s = get_scale();
-    audio.set_point(x/s, y/s);
+  static unique_ptr<map_tiles> new_tiles(const grainmap& map) {
+    return unique_ptr<map_tiles>(
+      new map_tiles(map, tiled_options().memory_budget /
+                    (4*map_tiles::tile_size*map_tiles::tile_size), false));
   }
 
-  bool on_button_press_event(GdkEventButton* event) {
-    // printf("down %d %d\n", event->x, event->y);
-    set_point(event->x, event->y);
+  // Show and play map instead, without restarting the audio client
+  void set_map(shared_ptr<grainmap> map) {
+    tiles = new_tiles(*map);
+    audio.set_map(map);
+    gm = map;
+
+    fit = true;
+    selected = active = -1;
+    cursor_shown = false;
+    invalidate_view();
+  }
+
+  // Keep the files either side of the current one ready
+  void prefetch_neighbours() {
+    vector<string> next;
+    const size_t n = paths.size();
+    if (n > 1)
+      next.push_back(paths[(current + 1) % n]);
+    if (n > 2)
+      next.push_back(paths[(current + n - 1) % n]);
+    if (n > 3)
+      next.push_back(paths[(current + 2) % n]);
+    library.prefetch(next);
+  }
+
+  void show_path(size_t i) {
+    shared_ptr<grainmap> map = load_map(library, paths[i]);
+    if (!map) return;
+    current = i;
+    set_map(map);
+    prefetch_neighbours();
+  }
+
+  void fit_view() {
+    const double side = tiles->side(0);
+    zoom = min(min(width/side, height/side), 1.0);
+    ox = oy = 0;
+  }
+
+  void invalidate_view() {
+    view_valid = false;
+    queue_draw();
+  }
+
+  void set_point(double x, double y) {
+    const double last = tiles->side(0) - 1;
+    const double mx = max(0.0, min(ox + x/zoom, last));
+    const double my = max(0.0, min(oy + y/zoom, last));
+    audio.set_point(mx, my);
+
+    invalidate_cursor();
+    cursor_shown = true;
+    cursor_x = mx;
+    cursor_y = my;
+    invalidate_cursor();
+  }
+
+  void invalidate_cursor() {
+    if (!cursor_shown) return;
+    const int r = cursor_radius + 2;
+    queue_draw_area((int)floor((cursor_x - ox)*zoom) - r,
+                    (int)floor((cursor_y - oy)*zoom) - r, 2*r + 1, 2*r + 1);
+  }
+
+  void select(double x, double y) {
+    const double last = tiles->side(0) - 1;
+    int64_t start, stop, starti = -1, endi = -1;
+    gm->lookup(max(0.0, min(ox + x/zoom, last)),
+              max(0.0, min(oy + y/zoom, last)),
+              start, stop, starti, endi);
+    const int64_t old = selected;
+    selected = gm->get_outlines().find(starti);
+    if (selected == old) return;
+    redraw_outline(old);
+    redraw_outline(selected);
+  }
+
+  // Re-segment at a new onset threshold
+  void set_threshold(float threshold) {
+    const int64_t sel = selected;
+    vector<int64_t> changed;
+    gm->set_threshold(threshold, changed);
+    edited(sel, changed);
+  }
+
+  // Split the region under the cursor there, or join the selected
+  // region to the one before it
+  void split() {
+    if (!cursor_shown) return;
+    const int64_t sel = selected;
+    vector<int64_t> changed;
+    if (gm->split(gm->index(cursor_x, cursor_y), changed))
+      edited(sel, changed);
+  }
+
+  void merge() {
+    const int64_t sel = selected;
+    vector<int64_t> changed;
+    if (sel >= 0 && gm->merge(sel, changed))
+      edited(sel, changed);
+  }
+
+  // Render again only the tiles under regions that changed, and find
+  // the selection, which started at sel, in the new outlines
+  void edited(int64_t sel, const vector<int64_t>& changed) {
+    const outline_table& outlines = gm->get_outlines();
+    for (size_t i=0; i<changed.size(); i++) {
+      const outline_table::outline& o = outlines.at(outlines.find(changed[i]));
+      tiles->invalidate(o.lo.x - 1, o.lo.y - 1, o.hi.x + 1, o.hi.y + 1);
+    }
+    selected = sel < 0 ? -1 : outlines.find(sel);
+    active = -1;
+    invalidate_view();
+  }
+
+  // Screen rectangle around the bounding box of the region starting at
+  // start, clipped to the widget; false if none of it is visible
+  bool outline_box(int64_t start, int& x, int& y, int& w, int& h) {
+    if (start < 0) return false;
+    const outline_table::outline& o = gm->get_outlines().at(start);
+    const int pad = 3;
+    x = max(0, (int)floor((o.lo.x - ox)*zoom) - pad);
+    y = max(0, (int)floor((o.lo.y - oy)*zoom) - pad);
+    w = min(width, (int)ceil((o.hi.x - ox)*zoom) + pad) - x;
+    h = min(height, (int)ceil((o.hi.y - oy)*zoom) + pad) - y;
+    return w > 0 && h > 0;
+  }
+
+  // Recompose the part of the view covered by the bounding box of the
+  // region starting at start
+  void redraw_outline(int64_t start) {
+    int x, y, w, h;
+    if (!view_valid || !outline_box(start, x, y, w, h)) return;
+    compose(Context::create(view), x, y, w, h);
+    view->mark_dirty(x, y, w, h);
+    queue_draw_area(x, y, w, h);
+  }
+
+  void invalidate_active() {
+    int x, y, w, h;
+    if (outline_box(active, x, y, w, h))
+      queue_draw_area(x, y, w, h);
+  }
+
+  // half the side of the playhead mark, in screen pixels
+  double head_half() {
+    return max(zoom/2, 2.0);
+  }
+
+  void invalidate_head() {
+    if (active < 0) return;
+    const double half = head_half();
+    const int x = (int)floor((head_x + 0.5 - ox)*zoom - half) - 1;
+    const int y = (int)floor((head_y + 0.5 - oy)*zoom - half) - 1;
+    const int side = (int)ceil(2*half) + 3;
+    queue_draw_area(x, y, side, side);
+  }
+
+  // Pick up what the audio thread last published and invalidate only
+  // the overlay marks that moved
+  bool poll_playhead() {
+    audio.release_maps();
+    playhead ph;
+    // until the audio thread takes up a new map it reports the old one
+    if (!audio.read_playhead(ph) || ph.map != gm.get())
+      return true;
+    const int64_t now = ph.starti < 0 ? -1 : gm->get_outlines().find(ph.starti);
+    int x = 0, y = 0;
+    if (now >= 0)
+      gm->coords(ph.index, x, y);
+    if (now == active && (now < 0 || (x == head_x && y == head_y)))
+      return true;
+
+    invalidate_head();
+    if (now != active) {
+      invalidate_active();
+      active = now;
+      invalidate_active();
+    }
+    head_x = x;
+    head_y = y;
+    invalidate_head();
     return true;
   }
 
-  double get_scale() {
-    Glib::RefPtr<Gdk::Window> window = get_window();
-    assert(window);
-    Gtk::Allocation allocation = get_allocation();
-    const int width = allocation.get_width();
-    const int height = allocation.get_height();
-    RefPtr<ImageSurface> img = gm.get_surface();
-    return min(min(width/(double)img->get_width(), height/(double)img->get_height()), 1.0);
+  // Move the view by whole screen pixels, reusing what stays on screen
+  void scroll_view(int dx, int dy) {
+    if (!dx && !dy) return;
+    fit = false;
+    ox -= dx/zoom;
+    oy -= dy/zoom;
+    if (!view_valid || abs(dx) >= width || abs(dy) >= height) {
+      invalidate_view();
+      return;
+    }
+
+    RefPtr<Context> c = Context::create(back);
+    c->set_source(view, dx, dy);
+    c->paint();
+    if (dx > 0)
+      compose(c, 0, 0, dx, height);
+    else if (dx < 0)
+      compose(c, width + dx, 0, -dx, height);
+    if (dy > 0)
+      compose(c, 0, 0, width, dy);
+    else if (dy < 0)
+      compose(c, 0, height + dy, width, -dy);
+    swap(view, back);
+    queue_draw();
+  }
+
+  static void trace(const RefPtr<Context>& c, const outline_table::outline& o) {
+    const outline_point* p = &o.points[0];
+    const outline_point* end = p + o.points.size();
+    c->move_to(p->x, p->y);
+    while (++p != end)
+      c->line_to(p->x, p->y);
+    c->close_path();
+  }
+
+  // Stroke the outline of every region that reaches into the map
+  // rectangle (x0,y0)-(x1,y1), about a screen pixel wide at any zoom,
+  // and the selected region's over them
+  void draw_outlines(const RefPtr<Context>& c, double x0, double y0,
+                     double x1, double y1)
+  {
+    const outline_table& outlines = gm->get_outlines();
+    c->save();
+    c->scale(zoom, zoom);
+    c->translate(-ox, -oy);
+    for (auto it=outlines.begin(); it!=outlines.end(); ++it) {
+      const outline_table::outline& o = it->second;
+      if (o.hi.x < x0 || o.lo.x > x1 || o.hi.y < y0 || o.lo.y > y1)
+        continue;
+      trace(c, o);
+    }
+    c->set_line_width(1/zoom);
+    c->set_source_rgba(1, 1, 1, 0.25);
+    c->stroke();
+    if (selected >= 0) {
+      trace(c, outlines.at(selected));
+      c->set_line_width(2.5/zoom);
+      c->set_source_rgba(1, 1, 1, 0.9);
+      c->stroke();
+    }
+    c->restore();
+  }
+
+  // Draw the tiles and outlines under the screen rectangle (x,y,w,h)
+  void compose(const RefPtr<Context>& c, int x, int y, int w, int h) {
+    c->save();
+    c->rectangle(x, y, w, h);
+    c->clip();
+    c->set_source_rgb(0, 0, 0);
+    c->paint();
+
+    // the coarsest level that still has a pixel per screen pixel
+    int level = 0;
+    while (level+1 < tiles->levels() && zoom*((int64_t)2 << level) <= 1)
+      level++;
+    const double scale = zoom*((int64_t)1 << level);
+    const int tw = tiles->tile_side(level);
+    const double span = tw*(double)((int64_t)1 << level);
+    const int n = tiles->tiles_across(level);
+    const double mx0 = ox + x/zoom, my0 = oy + y/zoom;
+    const double mx1 = ox + (x + w)/zoom, my1 = oy + (y + h)/zoom;
+    const int tx0 = max(0, (int)floor(mx0/span));
+    const int ty0 = max(0, (int)floor(my0/span));
+    const int tx1 = min(n, (int)ceil(mx1/span));
+    const int ty1 = min(n, (int)ceil(my1/span));
+    for (int ty=ty0; ty<ty1; ty++) {
+      for (int tx=tx0; tx<tx1; tx++) {
+        c->save();
+        c->translate((tx*span - ox)*zoom, (ty*span - oy)*zoom);
+        c->scale(scale, scale);
+        c->set_source(tiles->get(level, tx, ty), 0, 0);
+        if (scale > 1)
+          RefPtr<SurfacePattern>::cast_static(c->get_source())->set_filter(FILTER_NEAREST);
+        c->rectangle(0, 0, tw, tw);
+        c->fill();
+        c->restore();
+      }
+    }
+    draw_outlines(c, mx0, my0, mx1, my1);
+    c->restore();
+  }
+
+  void draw_overlay(const RefPtr<Context>& c) {
+    if (active >= 0) {
+      c->save();
+      c->scale(zoom, zoom);
+      c->translate(-ox, -oy);
+      trace(c, gm->get_outlines().at(active));
+      c->restore();
+      c->set_source_rgba(1, 1, 1, 0.2);
+      c->fill();
+
+      const double half = head_half();
+      c->rectangle((head_x + 0.5 - ox)*zoom - half,
+                   (head_y + 0.5 - oy)*zoom - half, 2*half, 2*half);
+      c->set_source_rgb(1, 1, 1);
+      c->fill();
+    }
+    if (cursor_shown) {
+      c->arc((cursor_x - ox)*zoom, (cursor_y - oy)*zoom, cursor_radius, 0, 2*M_PI);
+      c->set_line_width(1.5);
+      c->set_source_rgba(1, 1, 1, 0.9);
+      c->stroke();
+    }
+  }
+
+  void on_size_allocate(Gtk::Allocation& allocation) {
+    DrawingArea::on_size_allocate(allocation);
+    if (allocation.get_width() == width && allocation.get_height() == height)
+      return;
+    width = allocation.get_width();
+    height = allocation.get_height();
+    view.clear();
+    back.clear();
+    view_valid = false;
+  }
+
+  bool on_key_press_event(GdkEventKey* event) {
+    const size_t n = paths.size();
+    string path;
+    switch (event->keyval) {
+    case GDK_KEY_o:
+      if (choose_file(path)) {
+        paths.push_back(path);
+        show_path(n);
+        if (current != n)
+          paths.pop_back();
+      }
+      return true;
+    case GDK_KEY_n:
+      show_path((current + 1) % n);
+      return true;
+    case GDK_KEY_p:
+      show_path((current + n - 1) % n);
+      return true;
+    case GDK_KEY_bracketleft:
+      set_threshold(gm->get_threshold()*0.8);
+      return true;
+    case GDK_KEY_bracketright:
+      set_threshold(gm->get_threshold()*1.25);
+      return true;
+    case GDK_KEY_s:
+      split();
+      return true;
+    case GDK_KEY_m:
+      merge();
+      return true;
+    }
+    return false;
+  }
+
+  bool on_button_press_event(GdkEventButton* event) {
+    grab_focus();
+    // printf("down %d %d\n", event->x, event->y);
+    if (event->button == 1) {
+      set_point(event->x, event->y);
+      select(event->x, event->y);
+    }
+    pan_x = event->x;
+    pan_y = event->y;
+    return true;
   }
 
   bool on_motion_notify_event(GdkEventMotion* event) {
+    if (event->state & (GDK_BUTTON2_MASK | GDK_BUTTON3_MASK)) {
+      const int dx = (int)lround(event->x - pan_x);
+      const int dy = (int)lround(event->y - pan_y);
+      pan_x += dx;
+      pan_y += dy;
+      scroll_view(dx, dy);
+      return true;
+    }
     if (!(event->state & GDK_BUTTON1_MASK)) return true;
 
     // printf("%d %d\n", event->x, event->y);
@@ -73,89 +549,94 @@ public:
     return true;
   }
 
-  bool on_draw(const Cairo::RefPtr<Cairo::Context>& c) {
-    Gtk::Allocation allocation = get_allocation();
-    const int width = allocation.get_width();
-    const int height = allocation.get_height();
-
-    RefPtr<ImageSurface> img = gm.get_surface();
-    double s = get_scale();
-    if (s < 1.0)
-      c->scale(s,s);
-    c->set_source_rgb(0, 0, 0);
-    c->paint();
-    c->set_source(img, 0, 0);
-    c->paint();
+  bool on_scroll_event(GdkEventScroll* event) {
+    double factor;
+    if (event->direction == GDK_SCROLL_UP)
+      factor = 1.25;
+    else if (event->direction == GDK_SCROLL_DOWN)
+      factor = 0.8;
+    else
+      return true;
 
+    // zoom about the pointer
+    double mx = ox + event->x/zoom;
+    double my = oy + event->y/zoom;
+    fit = false;
+    zoom = max(min(zoom*factor, 64.0), 1.0/tiles->side(0));
+    ox = mx - event->x/zoom;
+    oy = my - event->y/zoom;
+    invalidate_view();
     return true;
   }
 
-};
+  bool on_draw(const Cairo::RefPtr<Cairo::Context>& c) {
+    if (width <= 0 || height <= 0)
+      return true;
+    if (!view_valid) {
+      if (fit)
+        fit_view();
+      if (!view) {
+        view = ImageSurface::create(FORMAT_RGB24, width, height);
+        back = ImageSurface::create(FORMAT_RGB24, width, height);
+      }
+      compose(Context::create(view), 0, 0, width, height);
+      view_valid = true;
+    }
 
-static bool msg_callback(Dialog* progress, ProgressBar* bar, atomic<bool>* grain_loaded) {
-  if (!grain_loaded->load()) {
-    bar->pulse();
+    // the expose's clip already limits this to the invalidated area
+    c->set_source(view, 0, 0);
+    c->paint();
+    draw_overlay(c);
     return true;
   }
 
-  progress->hide();
-
-  return false;
-}
+};
 
 static void print_usage(char* name) {
-  printf("usage: %s [file]\n", name);
+  printf("usage: %s [-m megabytes] [-z] [-a mix] [file or directory...]\n", name);
   exit(1);
 }
 
 int main(int argc, char* argv[]) {
   Gtk::Main kit(argc, argv);
   Gtk::Window window;
-  string path;
-  char c;
+  vector<string> paths;
+  size_t library_budget = (size_t)2048 << 20;
+  int c;
 
-  while ((c = getopt(argc, argv, "h")) != -1) {
+  while ((c = getopt(argc, argv, "hm:za:")) != -1) {
     switch (c) {
+    case 'm':
+      library_budget = (size_t)atol(optarg) << 20;
+      break;
+    case 'z':
+      command_options.collapse_silence = true;
+      break;
+    case 'a':
+      if (!parse_mix(optarg, command_options))
+        print_usage(argv[0]);
+      break;
     case 'h':
     default:
       print_usage(argv[0]);
     }
   }
 
-  if (optind < argc-1)
-    print_usage(argv[0]);
-
-  if (optind < argc)
-    path = argv[optind];
-  else {
-    FileChooserDialog dialog("Choose an audio sample to load", FILE_CHOOSER_ACTION_OPEN);
-    dialog.add_button(Gtk::Stock::CANCEL, Gtk::RESPONSE_CANCEL);
-    dialog.add_button("Select", RESPONSE_OK);
-    if (dialog.run() != RESPONSE_OK)
+  paths.assign(argv + optind, argv + argc);
+  if (paths.empty()) {
+    string path;
+    if (!choose_file(path))
       return 1;
-    dialog.hide();
-    path = dialog.get_filename();
-  }
-
-  unique_ptr<grain_widget> grain;
-  atomic<bool> grain_loaded(false);
-  thread t([&]() {
-      grain = unique_ptr<grain_widget>(new grain_widget(path));
-      grain_loaded.store(true);
-    });
-  t.detach();
-  Dialog progress;
-  ProgressBar bar;
-  //progress.set_default_size(640,100);
-  progress.set_resizable(false);
-  progress.get_vbox()->pack_end(bar, PACK_SHRINK);
-  progress.show_all();
-  Glib::signal_timeout().connect(sigc::bind(sigc::ptr_fun(msg_callback), &progress, &bar, &grain_loaded), 100);
-  progress.run();
-  //printf("foo bar\n");
-  // msg.hide();
-  window.add(*grain);
-  grain->show();
+    paths.push_back(path);
+  }
+
+  map_library library(tiled_options(), library_budget);
+  shared_ptr<grainmap> map = load_map(library, paths[0]);
+  if (!map)
+    return 1;
+  grain_widget grain(library, paths, map);
+  window.add(grain);
+  grain.show();
   Gtk::Main::run(window);
   return 0;
 }
@@ -0,0 +1,502 @@
+/* grainmap-cli.cpp
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "grainmap.h"
+#include "hilbert2d.h"
+#include "parallel.h"
+#include <sndfile.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+// Admits jobs while their estimated footprints fit within budget.  A
+// job that alone exceeds it still runs, once nothing else is.
+class memory_gate {
+  mutex m;
+  condition_variable cv;
+  size_t budget, used;
+
+public:
+  memory_gate(size_t budget) : budget(budget), used(0) {}
+
+  void acquire(size_t bytes) {
+    unique_lock<mutex> lock(m);
+    while (used && used + bytes > budget)
+      cv.wait(lock);
+    used += bytes;
+  }
+
+  void release(size_t bytes) {
+    lock_guard<mutex> lock(m);
+    used -= bytes;
+    cv.notify_all();
+  }
+};
+
+struct cli_options {
+  string out_dir;
+  bool binary;  // regions as packed records instead of CSV
+  bool png;
+  map_options map;
+};
+
+// what a load of path will hold at its peak: the samples, the drawn
+// image and the region raster beside it
+static size_t estimate_memory(const SF_INFO& info, const map_options& options) {
+  size_t audio = (size_t)info.frames*info.channels*sizeof(float);
+  int nsize = options.nsize ? options.nsize :
+    grainmap::pick_nsize(info.frames, options.memory_budget, options.draw_image);
+  size_t image = options.draw_image ? (size_t)8 << 2*nsize : 0;
+  return audio + image;
+}
+
+// Where each of paths' outputs go: out_dir, then the file's directory
+// relative to the deepest one all of them are under, then its name
+// without the extension.  Files that would share outputs with an
+// earlier one get an empty base, after saying so.
+static vector<string> output_bases(const string& out_dir,
+                                   const vector<string>& paths)
+{
+  // files that do not resolve will fail to open anyway, and go
+  // straight under out_dir
+  vector<string> dirs, names;
+  string common;
+  bool any = false;
+  for (size_t i=0; i<paths.size(); i++) {
+    char real[PATH_MAX];
+    if (!realpath(paths[i].c_str(), real)) {
+      dirs.push_back("");
+      names.push_back(paths[i].substr(paths[i].rfind('/') + 1));
+      continue;
+    }
+    string path = real;
+    size_t slash = path.rfind('/');
+    dirs.push_back(path.substr(0, slash + 1));
+    names.push_back(path.substr(slash + 1));
+    if (!any) {
+      common = dirs.back();
+      any = true;
+    }
+    size_t n = 0;
+    while (n < common.size() && n < dirs.back().size() &&
+           common[n] == dirs.back()[n])
+      n++;
+    // back to a whole directory
+    while (n > 0 && common[n-1] != '/')
+      n--;
+    common.resize(n);
+  }
+
+  vector<string> bases;
+  map<string, size_t> taken;
+  for (size_t i=0; i<paths.size(); i++) {
+    string name = names[i];
+    size_t dot = name.rfind('.');
+    if (dot != string::npos && dot > 0)
+      name.resize(dot);
+    const size_t under = dirs[i].empty() ? 0 : common.size();
+    string base = out_dir + "/" + dirs[i].substr(under) + name;
+    auto t = taken.insert(make_pair(base, i));
+    if (!t.second) {
+      fprintf(stderr, "%s: skipped, its outputs would overwrite those of %s\n",
+              paths[i].c_str(), paths[t.first->second].c_str());
+      base.clear();
+    }
+    bases.push_back(base);
+  }
+  return bases;
+}
+
+// Make the directories base is under, as far as they are missing
+static bool make_parent_dirs(const string& base) {
+  for (size_t slash = base.find('/', 1); slash != string::npos;
+       slash = base.find('/', slash + 1)) {
+    if (mkdir(base.substr(0, slash).c_str(), 0755) && errno != EEXIST)
+      return false;
+  }
+  return true;
+}
+
+// value's low bytes first into out
+static void put_le(unsigned char* out, uint64_t value, int bytes) {
+  for (int i=0; i<bytes; i++)
+    out[i] = value >> 8*i;
+}
+
+// One line per region: hilbert index, start sample, color.  The binary
+// form packs the same as little-endian int64, int64, int8, whatever
+// the host's byte order.
+static bool write_regions(const grainmap& gm, const string& base, bool binary) {
+  const region_table& regions = gm.get_regions();
+  string file = base + (binary ? ".regions" : ".csv");
+  FILE* f = fopen(file.c_str(), binary ? "wb" : "w");
+  if (!f) return false;
+  if (!binary)
+    fprintf(f, "index,sample,color\n");
+  for (auto it=regions.begin(); it!=regions.end(); ++it) {
+    if (binary) {
+      unsigned char record[17];
+      put_le(record, it->first, 8);
+      put_le(record + 8, it->second.sample, 8);
+      put_le(record + 16, it->second.color, 1);
+      fwrite(record, sizeof record, 1, f);
+    } else {
+      fprintf(f, "%lld,%lld,%d\n", (long long)it->first,
+              (long long)it->second.sample, it->second.color);
+    }
+  }
+  bool ok = !ferror(f);
+  return !fclose(f) && ok;
+}
+
+#ifdef __linux__
+// Paths waiting for a worker, each queued at most once at a time
+class path_queue {
+  mutex m;
+  condition_variable cv;
+  deque<string> paths;
+  set<string> queued;
+
+public:
+  void push(const string& path) {
+    lock_guard<mutex> lock(m);
+    if (queued.insert(path).second) {
+      paths.push_back(path);
+      cv.notify_one();
+    }
+  }
+
+  string pop() {
+    unique_lock<mutex> lock(m);
+    while (paths.empty())
+      cv.wait(lock);
+    string path = paths.front();
+    paths.pop_front();
+    queued.erase(path);
+    return path;
+  }
+};
+
+static const uint32_t watch_events =
+  IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF;
+
+// Watch dir and everything under it, queueing every file found
+static void watch_tree(int fd, const string& dir, map<int, string>& dirs,
+                       path_queue& queue)
+{
+  int wd = inotify_add_watch(fd, dir.c_str(), watch_events);
+  if (wd < 0) {
+    perror(dir.c_str());
+    return;
+  }
+  dirs[wd] = dir;
+  DIR* d = opendir(dir.c_str());
+  if (!d) return;
+  vector<string> names;
+  while (dirent* e = readdir(d))
+    if (e->d_name[0] != '.')
+      names.push_back(e->d_name);
+  closedir(d);
+  for (size_t i=0; i<names.size(); i++) {
+    string path = dir + "/" + names[i];
+    struct stat st;
+    if (stat(path.c_str(), &st))
+      continue;
+    if (S_ISDIR(st.st_mode))
+      watch_tree(fd, path, dirs, queue);
+    else if (S_ISREG(st.st_mode))
+      queue.push(path);
+  }
+}
+
+// Lowest CPU priority and idle I/O class, so interactive loads of the
+// same files always come first.  glibc has no ioprio_set() wrapper;
+// the constants are IOPRIO_WHO_PROCESS and IOPRIO_CLASS_IDLE.
+static void lower_priority() {
+  if (setpriority(PRIO_PROCESS, 0, 19))
+    perror("setpriority");
+  const int who_process = 1, idle_class = 3, class_shift = 13;
+  if (syscall(SYS_ioprio_set, who_process, 0, idle_class << class_shift))
+    perror("ioprio_set");
+}
+
+// Keep the analysis cache current for every audio file under dirs,
+// now and as files are written or moved in.  Never returns.
+static int watch_dirs(const vector<string>& dirs, map_options options,
+                      int threads, size_t budget)
+{
+  lower_priority();
+  options.draw_image = false;
+  if (options.cache_dir.empty())
+    options.cache_dir = default_cache_dir();
+  if (options.cache_dir.empty()) {
+    fprintf(stderr, "no cache directory\n");
+    return 1;
+  }
+
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) {
+    perror("inotify_init1");
+    return 1;
+  }
+  path_queue queue;
+  map<int, string> watched;
+  for (size_t i=0; i<dirs.size(); i++)
+    watch_tree(fd, dirs[i], watched, queue);
+
+  thread events([&]() {
+      char buf[64 << 10] __attribute__((aligned(__alignof__(inotify_event))));
+      for (;;) {
+        ssize_t len = read(fd, buf, sizeof buf);
+        if (len <= 0) {
+          perror("inotify read");
+          exit(1);
+        }
+        for (char* p = buf; p < buf + len; ) {
+          const inotify_event* e = (const inotify_event*)p;
+          p += sizeof(inotify_event) + e->len;
+          if (e->mask & IN_Q_OVERFLOW) {
+            // events were lost: look everything over again, and let
+            // the workers skip what is still cached
+            for (size_t i=0; i<dirs.size(); i++)
+              watch_tree(fd, dirs[i], watched, queue);
+            continue;
+          }
+          auto dir = watched.find(e->wd);
+          if (dir == watched.end())
+            continue;
+          if (e->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+            watched.erase(dir);
+            continue;
+          }
+          if (!e->len || e->name[0] == '.')
+            continue;
+          string path = dir->second + "/" + e->name;
+          if (e->mask & IN_ISDIR) {
+            if (e->mask & (IN_CREATE | IN_MOVED_TO))
+              watch_tree(fd, path, watched, queue);
+          } else if (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            queue.push(path);
+          }
+        }
+      }
+    });
+
+  // half the cores unless told otherwise; this is background work
+  if (!threads)
+    threads = max(default_threads()/2, 1);
+  memory_gate gate(budget);
+  mutex print_lock;
+  parallel_for(threads, threads,
+               [&](int, size_t, size_t) {
+      for (;;) {
+        string path = queue.pop();
+        if (grainmap::analysis_cached(path, options))
+          continue;
+        SF_INFO info = {0};
+        SNDFILE* file = sf_open(path.c_str(), SFM_READ, &info);
+        if (!file)
+          continue;
+        sf_close(file);
+
+        const size_t bytes = estimate_memory(info, options);
+        gate.acquire(bytes);
+        auto t0 = chrono::steady_clock::now();
+        string error; // replaced or cut short since the probe, say
+        try {
+          grainmap gm(path, 0, options);
+        } catch (load_error& e) {
+          error = e.what();
+        } catch (exception& e) {
+          error = path + ": " + e.what();
+        }
+        gate.release(bytes);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+
+        lock_guard<mutex> lock(print_lock);
+        if (!error.empty())
+          fprintf(stderr, "%s\n", error.c_str());
+        else
+          printf("%s\tcached\t%.1f ms\n", path.c_str(), ms);
+        fflush(stdout);
+      }
+    });
+  events.join();
+  return 0;
+}
+#endif
+
+static void print_usage(char* name) {
+  printf("usage: %s [-o dir] [-j threads] [-m megabytes] [-n nsize] [-g dB] [-z] [-a mix] [-c] [-b] [-s]\n"
+         "          file...\n"
+         "       %s -w [-j threads] [-m megabytes] [-g dB] [-z] [-a mix] dir...\n"
+         "  -o  write outputs to dir (default .), under the same\n"
+         "      directories the files are in below the one they share\n"
+         "  -j  files analyzed at once (default one per core)\n"
+         "  -m  memory all files in flight may take (default 1024)\n"
+         "  -n  map size as a power of two (default picked per file)\n"
+         "  -g  skip onset detection where quieter than this (default -60)\n"
+         "  -z  give long stretches that quiet next to no room on the map\n"
+         "  -a  find onsets in all channels (default), their mono sum, the\n"
+         "      loudest, ms (mid and side), or channels like 0,1,4\n"
+         "  -c  read and write the analysis cache\n"
+         "  -b  write regions as packed binary records instead of CSV\n"
+         "  -s  skip the PNG\n"
+         "  -w  watch dirs at low priority, keeping the analysis cache of\n"
+         "      every audio file under them current\n", name, name);
+  exit(1);
+}
+
+int main(int argc, char* argv[]) {
+  cli_options options;
+  options.out_dir = ".";
+  options.binary = false;
+  options.png = true;
+  int threads = 0;
+  size_t budget = (size_t)1024 << 20;
+  bool watch = false;
+  int c;
+
+  while ((c = getopt(argc, argv, "o:j:m:n:g:za:cbswh")) != -1) {
+    switch (c) {
+    case 'o': options.out_dir = optarg; break;
+    case 'j': threads = atoi(optarg); break;
+    case 'm': budget = (size_t)atol(optarg) << 20; break;
+    case 'n': options.map.nsize = atoi(optarg); break;
+    case 'g': options.map.silence_db = atof(optarg); break;
+    case 'z': options.map.collapse_silence = true; break;
+    case 'a':
+      if (!parse_mix(optarg, options.map))
+        print_usage(argv[0]);
+      break;
+    case 'c': options.map.cache_dir = default_cache_dir(); break;
+    case 'b': options.binary = true; break;
+    case 's': options.png = false; break;
+    case 'w': watch = true; break;
+    case 'h':
+    default:
+      print_usage(argv[0]);
+    }
+  }
+  if (optind == argc)
+    print_usage(argv[0]);
+  if (options.map.nsize && (options.map.nsize < min_nsize || options.map.nsize > max_nsize)) {
+    fprintf(stderr, "nsize must be from %d to %d\n", min_nsize, max_nsize);
+    return 1;
+  }
+  vector<string> paths(argv + optind, argv + argc);
+  if (watch) {
+#ifdef __linux__
+    return watch_dirs(paths, options.map, threads, budget);
+#else
+    fprintf(stderr, "watching needs inotify\n");
+    return 1;
+#endif
+  }
+
+  options.map.draw_image = options.png;
+  // each file's image gets its share of the budget
+  options.map.memory_budget = budget/(threads ? threads : default_threads());
+
+  memory_gate gate(budget);
+  mutex print_lock;
+  atomic<int> failed(0);
+  auto start = chrono::steady_clock::now();
+  const vector<string> bases = output_bases(options.out_dir, paths);
+
+  parallel_each(threads, paths.size(), [&](int, size_t i) {
+      const string& path = paths[i];
+      const string& base = bases[i];
+      if (base.empty()) {
+        failed++;
+        return;
+      }
+      SF_INFO info = {0};
+      SNDFILE* file = sf_open(path.c_str(), SFM_READ, &info);
+      if (!file) {
+        lock_guard<mutex> lock(print_lock);
+        fprintf(stderr, "%s: %s\n", path.c_str(), sf_strerror(0));
+        failed++;
+        return;
+      }
+      sf_close(file);
+
+      const size_t bytes = estimate_memory(info, options.map);
+      gate.acquire(bytes);
+      auto t0 = chrono::steady_clock::now();
+      bool ok;
+      size_t regions;
+      string error; // changed since the probe above, or out of memory
+      try {
+        grainmap gm(path, 0, options.map);
+        ok = make_parent_dirs(base) && write_regions(gm, base, options.binary);
+        if (options.png && gm.get_surface())
+          gm.get_surface()->write_to_png(base + ".png");
+        else if (options.png)
+          fprintf(stderr, "%s: map too large for a PNG\n", path.c_str());
+        regions = gm.get_regions().size();
+      } catch (load_error& e) {
+        error = e.what();
+      } catch (exception& e) {
+        error = path + ": " + e.what();
+      }
+      gate.release(bytes);
+      if (!error.empty()) {
+        lock_guard<mutex> lock(print_lock);
+        fprintf(stderr, "%s\n", error.c_str());
+        failed++;
+        return;
+      }
+      double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+
+      lock_guard<mutex> lock(print_lock);
+      if (!ok) {
+        fprintf(stderr, "%s: could not write regions\n", path.c_str());
+        failed++;
+      }
+      printf("%s\t%lld frames\t%zu regions\t%.1f ms\n", path.c_str(),
+             (long long)info.frames, regions, ms);
+      fflush(stdout);
+    });
+
+  double s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  printf("%zu files in %.2f s, %d failed\n", paths.size(), s, (int)failed);
+  return failed ? 1 : 0;
+}
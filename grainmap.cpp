@@ -19,12 +19,13 @@
  */
 
 #include "grainmap.h"
-#include "hilbert.h"
+#include "hilbert2d.h"
 #include "five-color.h"
+#include "region-graph.h"
+#include "parallel.h"
 
 #include <stdio.h>
 #include <math.h>
-#include <samplerate.h>
 #include <sndfile.h>
 #include <assert.h>
 #include <stdlib.h>
@@ -33,126 +34,24 @@
 #include <limits.h>
 #include <string.h>
 #include <aubio.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <mutex>
+#include <atomic>
+#include <errno.h>
+#include <unistd.h>
+#include <functional>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
-class env_fol {
-  float level;
-  float decay;
-
-public:
-  env_fol(float decay) : level(0), decay(decay) {}
-
-  void process(float* data, int num) {
-    while (--num>=0) {
-      float in = fabsf(*data);
-      *data++ = level = (in >= level ? in : (in + decay*(level - in)));
-    }
-  }
-};
-
-static inline bool in_bounds(int nsize, bitmask_t coords[2]) {
-  bitmask_t max = 1 << nsize;
-  return coords[0] >= 0 && coords[1] >= 0 && coords[0] < max && coords[1] < max;
-}
-
-struct region {
-  int start, end;
-
-  bool contains(int point) {
-    return point >= start && point < end;
-  }
-};
-
-typedef map<int,five_color::vertex*> region_map;
-
-static inline region_map::iterator find_vertex(region_map& regions, int index) {
-  assert(index >= 0);
-  return --regions.upper_bound(index);
-}
-
-static inline void traverse_region(region r,
-                                   five_color::vertex* vtx,
-                                   five_color& fc,
-                                   region_map& regions,
-                                   int nsize)
-{
-  //printf("traverse begin\n");
-
-  bitmask_t coords[2], orig_coords[2];
-  hilbert_i2c(2, nsize, r.start, coords);
-
-  int nx, ny;
-  if (r.start) {
-    bitmask_t last_coords[2];
-    hilbert_i2c(2, nsize, r.start-1, last_coords);
-    nx = last_coords[0] - coords[0];
-    ny = last_coords[1] - coords[1];
-  } else {
-    nx = 0;
-    ny = -1;
-  }
-  bitmask_t foreign_coords[2];
-  orig_coords[0] = foreign_coords[0] = coords[0] + nx;
-  orig_coords[1] = foreign_coords[1] = coords[1] + ny;
-
-  int iter = 0;
-  region foreign_region = {0,-1};
-  do {
-    int index;
-    if (in_bounds(nsize, foreign_coords) &&
-        !(foreign_region.contains(index=hilbert_c2i(2, nsize, foreign_coords))))
-    {
-      //printf("traverse handle %d %d\n", index, r.contains(index));
-      if (r.contains(index)) {
-        coords[0] = foreign_coords[0];
-        coords[1] = foreign_coords[1];
-        // rotate normal counterclockwise
-        //printf("traverse rotate normal counterclockwise\n");
-        int tnx = nx;
-        nx = ny;
-        ny = -tnx;
-      } else {
-        //printf("traverse new region\n");
-        // new region
-        auto it = find_vertex(regions, index);
-        assert(it != regions.end());
-        assert(it->second != vtx);
-        //printf("add edge %p -> %p\n", vtx, it->second);
-        fc.add_edge(vtx, it->second);
-        foreign_region.start = it->first;
-        foreign_region.end = it == regions.end() ? INT_MAX : (++it)->first;
-      }
-    }
-
-    // move clockwise-normal
-    coords[0] -= ny;
-    coords[1] += nx;
-    if (!(in_bounds(nsize, coords) &&
-          r.contains(hilbert_c2i(2, nsize, coords))))
-    {
-      //printf("traverse go back\n");
-      // go back
-      coords[0] += ny;
-      coords[1] -= nx;
-
-      // rotate normal clockwise
-      int tnx = nx;
-      nx = -ny;
-      ny = tnx;
-    }
-    iter++;
-
-    foreign_coords[0] = coords[0] + nx;
-    foreign_coords[1] = coords[1] + ny;
-  } while (foreign_coords[0] != orig_coords[0] || foreign_coords[1] != orig_coords[1]);
-}
-
 static const int BUF_SIZE = 256;
 
 struct audio_file {
   float* data;
-  int size;
+  sf_count_t size;
 
   audio_file(const string& path) {
     SF_INFO info = {0};
@@ -169,12 +68,12 @@ struct audio_file {
     delete data;
   }
 
-  inline float operator[](int i) const {
+  inline float operator[](sf_count_t i) const {
     return data[i];
   }
 };
 
-static const float colors[][3] = {
+const float map_colors[5][3] = {
   {119,32,61},
   {211,80,63},
   {217,152,28},
@@ -194,184 +93,783 @@ static const float colors[][3] = {
   // {166,62,56}
 };
 
-struct grain_draw {
-  region_map::iterator it, end;
-  int color, end_samp, i;
+// Brightness of a followed peak, 1 + ln(v)*0.15 clamped to [0,1] and
+// scaled to 0-255, looked up by the exponent and top mantissa bits of v
+class shade_table {
+  enum { low_exp = -10, octaves = 10, mantissa_bits = 8 };
+  unsigned char table[octaves << mantissa_bits];
+  uint32_t low, high;
 
-  grain_draw(region_map::iterator begin, region_map::iterator end)
-    : it(begin),
-      end(end),
-      end_samp(-1),
-      i(0)
-  {
+  static uint32_t bits(float v) {
+    uint32_t b;
+    memcpy(&b, &v, sizeof b);
+    return b;
   }
 
-  void process(cairo_image& img, int nsize, float* data, int size) {
-    while (--size>=0) {
-      if (i >= end_samp) {
-        color = it->second->color;
-        end_samp = ++it == end ? INT_MAX : it->first;
-        //printf("process color %d %d\n", color, end_samp);
+  static float value(uint32_t b) {
+    float v;
+    memcpy(&v, &b, sizeof v);
+    return v;
+  }
+
+public:
+  shade_table() : low(bits(ldexpf(1, low_exp))), high(bits(1)) {
+    for (int i=0; i<octaves << mantissa_bits; i++) {
+      // middle of the bucket
+      uint32_t b = low + ((uint32_t)i << (23-mantissa_bits)) + (1 << (22-mantissa_bits));
+      double p = 1 + log(value(b))*0.15;
+      table[i] = max(0.0, min(p, 1.0))*255 + 0.5;
+    }
+  }
+
+  unsigned char operator()(float v) const {
+    uint32_t b = bits(v);
+    // too quiet, negative or NaN
+    if (b < low || b > 0x7f800000)
+      return 0;
+    if (b >= high)
+      return 255;
+    return table[(b - low) >> (23-mantissa_bits)];
+  }
+};
+
+static uint32_t shade_rgb(int color, int s) {
+  const float* col = map_colors[color];
+  unsigned char r = col[0]*s/255, g = col[1]*s/255, b = col[2]*s/255;
+  return r << 16 | g << 8 | b;
+}
+
+uint32_t shade_pixel(int color, float level) {
+  static const shade_table shade;
+  return shade_rgb(color, shade(level));
+}
+
+uint32_t outline_pixel(uint32_t pixel) {
+  unsigned char r = (pixel >> 16) & 0xFF;
+  unsigned char g = (pixel >> 8) & 0xFF;
+  unsigned char b = pixel & 0xFF;
+  double p = 0.10;
+  double q = 1-p;
+  r = r*q + 255*p;
+  g = g*q + 255*p;
+  b = b*q + 255*p;
+  return r << 16 | g << 8 | b;
+}
+
+// Paints the map a 64x64 sub-square at a time.  Every aligned
+// sub-square is one stretch of the curve, traced the same way up to
+// rotation and reflection, so the pixels of a stretch come from a
+// table per orientation instead of a Hilbert conversion each.
+template <int N>
+class span_painter {
+public:
+  enum { square_nsize = 6, square_len = 1 << 2*square_nsize };
+
+private:
+  enum { side = 1 << square_nsize };
+
+  uint32_t* pixels;
+  uint32_t* ids;
+  const region_map& regions;
+  const shade_table& shade;
+  vector<uint32_t> offsets[8];
+  bitmask_t first_at[8][2], last_at[8][2];
+  uint32_t palette[5][256];
+
+  static void orient(int o, bitmask_t x, bitmask_t y, bitmask_t coords[2]) {
+    if (o & 1) swap(x, y);
+    if (o & 2) x = side-1 - x;
+    if (o & 4) y = side-1 - y;
+    coords[0] = x;
+    coords[1] = y;
+  }
+
+public:
+  // ids, if given, is a 2^N square raster that gets the hilbert index
+  // each pixel's region starts at, which fits in 32 bits for every N
+  // up to 16
+  span_painter(cairo_image& img, uint32_t* ids, const region_map& regions,
+               const shade_table& shade)
+    : pixels((uint32_t*)img.data),
+      ids(ids),
+      regions(regions),
+      shade(shade)
+  {
+    assert(img.stride == 4 << N);
+    for (int o=0; o<8; o++) {
+      offsets[o].resize(square_len);
+      for (int j=0; j<square_len; j++) {
+        bitmask_t c[2], t[2];
+        hilbert2d_i2c<square_nsize>(j, c);
+        orient(o, c[0], c[1], t);
+        offsets[o][j] = (t[1] << N) + t[0];
+        if (j == 0)
+          copy(t, t+2, first_at[o]);
+        if (j == square_len-1)
+          copy(t, t+2, last_at[o]);
       }
+    }
+    for (int c=0; c<5; c++)
+      for (int s=0; s<256; s++)
+        palette[c][s] = shade_rgb(c, s);
+  }
+
+  // Paint indices [first, first+square_len), whose followed peaks are
+  // levels[0] on.  first must start a sub-square.
+  void paint(int64_t first, const float* levels) const {
+    assert(first % square_len == 0);
+    bitmask_t a[2], b[2];
+    hilbert2d_i2c<N>(first, a);
+    hilbert2d_i2c<N>(first + square_len-1, b);
+    const bitmask_t ox = a[0] & ~(bitmask_t)(side-1);
+    const bitmask_t oy = a[1] & ~(bitmask_t)(side-1);
+    int o = 0;
+    while (first_at[o][0] != a[0]-ox || first_at[o][1] != a[1]-oy ||
+           last_at[o][0] != b[0]-ox || last_at[o][1] != b[1]-oy) {
+      o++;
+      assert(o < 8);
+    }
 
-      bitmask_t coords[2];
-      hilbert_i2c(2, nsize, i++, coords);
-      const float* col = colors[color];
-      //float v = (*data++)*0.85 + 0.15;
-      double p = 1 + log(*data++)*0.15;
-      if (p > 1) p = 1;
-      if (p < 0) p = 0;
-      if (std::isnan(p)) p = 0;
-      assert(p >= 0 && p <= 1);
-      //double p = 1.4;
-      img.set(coords[0], coords[1],
-              col[0]*p,
-              col[1]*p,
-              col[2]*p);
-      //printf("    v %f\n", v);
+    uint32_t* base = pixels + (oy << N) + ox;
+    uint32_t* id_base = ids + (oy << N) + ox;
+    const uint32_t* off = &offsets[o][0];
+    auto it = --regions.upper_bound(first);
+    for (int j=0; j<square_len;) {
+      const int color = it->second->color;
+      assert(color >= 0 && color < 5);
+      const uint32_t* row = palette[color];
+      const uint32_t id = it->first;
+      ++it;
+      const int stop = it == regions.end() ? square_len :
+        (int)min(it->first - first, (int64_t)square_len);
+      if (ids)
+        for (int k=j; k<stop; k++)
+          id_base[off[k]] = id;
+      for (; j<stop; j++)
+        base[off[j]] = row[shade(levels[j])];
     }
   }
 };
 
-static unique_ptr<audio_data> read_and_detect(const std::string& path,
-                                              map<int,int>& regions,
-                                              int out_size)
+// Frames decoded so far across all the files of a load
+struct decode_progress {
+  load_progress* progress;
+  atomic<int64_t> done;
+  int64_t total;
+
+  decode_progress(load_progress* progress, int64_t total)
+    : progress(progress), done(0), total(total) {}
+
+  bool cancelled() const {
+    return progress && progress->cancelled();
+  }
+
+  void add(int64_t frames) {
+    int64_t now = done += frames;
+    if (progress && total)
+      progress->advance(now/(double)total);
+  }
+};
+
+// aubio's FFT plans may not be made or freed on two threads at once
+static mutex aubio_lock;
+
+// Onset candidates from one file's detection scores, a hop each, the
+// file starting at sample start.  Every local peak of the score is a
+// candidate, as strong as it stands above the median of the hops
+// around it relative to their mean; aubio's peak picker compares the
+// same against its threshold.  The file's first sample is always one.
+static void pick_candidates(const vector<float>& scores, int64_t start,
+                            vector<onset_candidate>& out)
 {
-  SF_INFO info = {0};
-  SNDFILE* file = sf_open(path.c_str(), SFM_READ, &info);
-  assert(file);
-  double ratio = out_size/(double)info.frames;
-  unique_ptr<audio_data> adata(new audio_data(info.frames, info.channels));
-  unique_ptr<float[]> buf(new float[info.frames*info.channels]);
-  aubio_onset_t* onset = new_aubio_onset(aubio_onset_kl, BUF_SIZE*2, BUF_SIZE, 1);
-  auto ins = regions.begin();
-  fvec_t* in_vec = new_fvec(BUF_SIZE, info.channels);
-  fvec_t* onset_vec = new_fvec(1,1);
-  int cur_sample = 0;
-  int num;
+  onset_candidate first = {start, INFINITY};
+  out.push_back(first);
+  // aubio's window, a hop before and five after
+  const int pre = 1, post = 5;
+  float window[pre + post + 1];
+  for (size_t h=2; h+1<scores.size(); h++) {
+    if (!(scores[h] > scores[h-1] && scores[h] >= scores[h+1]))
+      continue;
+    int n = 0;
+    double sum = 0;
+    for (size_t k=h-pre; k<=h+post && k<scores.size(); k++) {
+      window[n++] = scores[k];
+      sum += scores[k];
+    }
+    nth_element(window, window + n/2, window + n);
+    const double mean = sum/n;
+    if (mean <= 0)
+      continue;
+    const float strength = (scores[h] - window[n/2])/mean;
+    if (strength <= 0)
+      continue;
+    // the start of the hop's analysis window
+    onset_candidate c = {start + (int64_t)(h-1)*BUF_SIZE, strength};
+    out.push_back(c);
+  }
+}
+
+// Runs of silent hops, which score nothing, as sample spans, if they
+// last long enough to be worth collapsing; scores are a file's, from
+// sample start to end.  The last hops of each run are left out, as
+// the onset that ends it may be placed there.
+static void find_silences(const vector<float>& scores, int64_t start,
+                          int64_t end, vector<pair<int64_t,int64_t> >& out)
+{
+  const size_t min_hops = 64, margin = 2;
+  size_t h = 0;
+  while (h < scores.size()) {
+    if (scores[h] != 0) {
+      h++;
+      continue;
+    }
+    size_t last = h;
+    while (last < scores.size() && scores[last] == 0)
+      last++;
+    if (last - h >= min_hops)
+      out.push_back(make_pair(start + (int64_t)h*BUF_SIZE,
+                              min(start + (int64_t)(last - margin)*BUF_SIZE, end)));
+    h = last;
+  }
+}
+
+// Split num interleaved frames of buf into channel arrays; four
+// channels of four frames make one transpose
+static void deinterleave(const float* buf, int channels, int num,
+                         float* const* out)
+{
+  int c = 0;
+#ifdef __SSE2__
+  for (; c+4 <= channels; c += 4) {
+    int i = 0;
+    for (; i+4 <= num; i += 4) {
+      const float* in = buf + (size_t)i*channels + c;
+      __m128 r0 = _mm_loadu_ps(in);
+      __m128 r1 = _mm_loadu_ps(in + channels);
+      __m128 r2 = _mm_loadu_ps(in + 2*channels);
+      __m128 r3 = _mm_loadu_ps(in + 3*channels);
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      _mm_storeu_ps(out[c] + i, r0);
+      _mm_storeu_ps(out[c+1] + i, r1);
+      _mm_storeu_ps(out[c+2] + i, r2);
+      _mm_storeu_ps(out[c+3] + i, r3);
+    }
+    for (; i<num; i++)
+      for (int k=0; k<4; k++)
+        out[c+k][i] = buf[(size_t)i*channels + c+k];
+  }
+  if (channels - c >= 2) {
+    // a pair left over, as in stereo: two loads hold four frames
+    int i = 0;
+    for (; i+4 <= num; i += 4) {
+      const float* in = buf + (size_t)i*channels + c;
+      __m128 a, b;
+      if (channels == 2) {
+        a = _mm_loadu_ps(in);
+        b = _mm_loadu_ps(in + 4);
+      } else {
+        a = _mm_setr_ps(in[0], in[1], in[channels], in[channels+1]);
+        b = _mm_setr_ps(in[2*channels], in[2*channels+1],
+                        in[3*channels], in[3*channels+1]);
+      }
+      _mm_storeu_ps(out[c] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+      _mm_storeu_ps(out[c+1] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    for (; i<num; i++)
+      for (int k=0; k<2; k++)
+        out[c+k][i] = buf[(size_t)i*channels + c+k];
+    c += 2;
+  }
+#endif
+  for (; c<channels; c++)
+    for (int i=0; i<num; i++)
+      out[c][i] = buf[(size_t)i*channels + c];
+}
+
+// dst[i] += k*src[i]
+static void add_scaled(float* dst, const float* src, float k, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  const __m128 kk = _mm_set1_ps(k);
+  for (; i+4 <= n; i += 4)
+    _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i),
+                                      _mm_mul_ps(kk, _mm_loadu_ps(src + i))));
+#endif
+  for (; i<n; i++)
+    dst[i] += k*src[i];
+}
+
+static double sum_squares(const float* x, int n) {
+  int i = 0;
+  double sum = 0;
+#ifdef __SSE2__
+  __m128 acc = _mm_setzero_ps();
+  for (; i+4 <= n; i += 4) {
+    __m128 v = _mm_loadu_ps(x + i);
+    acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, acc);
+  sum = (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for (; i<n; i++)
+    sum += x[i]*x[i];
+  return sum;
+}
+
+// How many signals options' mix makes of a file's channels: the
+// channels it takes, in order, if it takes them as they are
+static int mix_count(const map_options& options, int channels,
+                     vector<int>& picked)
+{
+  picked.clear();
+  switch (channels < 2 && options.mix == mix_mid_side ? mix_all : options.mix) {
+  case mix_mono:
+  case mix_loudest:
+    return 1;
+  case mix_mid_side:
+    return 2;
+  case mix_subset:
+    for (int c=0; c<channels && c<64; c++)
+      if (options.mix_channels >> c & 1)
+        picked.push_back(c);
+    if (picked.empty())
+      picked.push_back(0);
+    return picked.size();
+  case mix_all:
+    break;
+  }
+  for (int c=0; c<channels; c++)
+    picked.push_back(c);
+  return channels;
+}
+
+// Decode file, which this closes, into adata from frame offset on and,
+// if scores is given, fill it with the onset detection function, a
+// hop each, of the file mixed down as options say.  Hops whose mean
+// power is below options.silence_db skip the spectrum and score
+// nothing.  Files with fewer channels than adata repeat theirs across
+// it.
+static void read_and_detect(SNDFILE* file, const SF_INFO& info,
+                            audio_data& adata, int64_t offset,
+                            vector<float>* scores, const map_options& options,
+                            decode_progress& progress)
+{
+  unique_ptr<float[]> buf(new float[BUF_SIZE*info.channels]);
+  vector<int> picked;
+  const int mixed = mix_count(options, info.channels, picked);
+  vector<double> power(info.channels);
+  vector<float*> out(adata.channels);
+  aubio_pvoc_t* pvoc;
+  aubio_onsetdetection_t* detect;
+  fvec_t* in_vec;
+  fvec_t* last_vec;
+  cvec_t* grain;
+  fvec_t* onset_vec;
+  {
+    lock_guard<mutex> guard(aubio_lock);
+    pvoc = new_aubio_pvoc(BUF_SIZE*2, BUF_SIZE, mixed);
+    detect = new_aubio_onsetdetection(aubio_onset_kl, BUF_SIZE*2, mixed);
+    in_vec = new_fvec(BUF_SIZE, mixed);
+    last_vec = new_fvec(BUF_SIZE, mixed);
+    grain = new_cvec(BUF_SIZE*2, mixed);
+    onset_vec = new_fvec(1, mixed);
+  }
+  if (scores) {
+    scores->clear();
+    scores->reserve(info.frames/BUF_SIZE + 1);
+  }
+  // total squared amplitude below which a full hop is silent
+  const double gate = pow(10, options.silence_db/10)*BUF_SIZE*info.channels;
+  bool gated = false;
+  int64_t cur_sample = 0;
+  sf_count_t num;
+  bool cancelled = false;
   while ((num=sf_readf_float(file, buf.get(), BUF_SIZE))) {
     //printf("num %d\n", num);
+    if (!(cur_sample & (BUF_SIZE*64-1))) {
+      if ((cancelled = progress.cancelled()))
+        break;
+      if (cur_sample)
+        progress.add(BUF_SIZE*64);
+    }
 
+    for (int chan=0; chan<adata.channels; chan++)
+      out[chan] = adata.data[chan] + offset + cur_sample;
+    deinterleave(buf.get(), info.channels, num, &out[0]);
+    for (int chan=info.channels; chan<adata.channels; chan++)
+      copy(out[chan % info.channels], out[chan % info.channels] + num, out[chan]);
+    if (!scores) {
+      cur_sample += num;
+      continue;
+    }
+
+    double total = 0;
     for (int chan=0; chan<info.channels; chan++)
-      for (int i=0; i<num; i++) {
-        adata->data[chan][cur_sample+i] =
-          in_vec->data[chan][i] =
-          buf[i*info.channels + chan];
+      total += power[chan] = sum_squares(out[chan], num);
+    swap(in_vec, last_vec);
+    if (picked.empty()) {
+      float** in = in_vec->data;
+      fill(in[0], in[0] + BUF_SIZE, 0.0f);
+      if (options.mix == mix_mono) {
+        for (int chan=0; chan<info.channels; chan++)
+          add_scaled(in[0], out[chan], 1.0f/info.channels, num);
+      } else if (options.mix == mix_loudest) {
+        int loudest = max_element(power.begin(), power.end()) - power.begin();
+        copy(out[loudest], out[loudest] + num, in[0]);
+      } else {
+        fill(in[1], in[1] + BUF_SIZE, 0.0f);
+        add_scaled(in[0], out[0], 0.5f, num);
+        add_scaled(in[0], out[1], 0.5f, num);
+        add_scaled(in[1], out[0], 0.5f, num);
+        add_scaled(in[1], out[1], -0.5f, num);
       }
-
-    aubio_onset(onset, in_vec, onset_vec);
-    if (**onset_vec->data || !cur_sample) {
-      // TODO backtrack to zero crossing
-      // TODO record actual cur_sample
-      int samp = max(cur_sample - BUF_SIZE*4, 0);
-      int pos = max((int)(samp*ratio), 0);
-      //printf("onset %d %d\n", pos, cur_sample);
-      ins = regions.insert(ins, map<int,int>::value_type(pos, samp));
+    } else {
+      for (int m=0; m<mixed; m++)
+        copy(out[picked[m]], out[picked[m]] + num, in_vec->data[m]);
     }
 
+    if (num < BUF_SIZE)
+      for (int m=0; m<mixed; m++)
+        fill(in_vec->data[m] + num, in_vec->data[m] + BUF_SIZE, 0.0f);
     cur_sample += num;
+
+    if (total < gate) {
+      gated = true;
+      scores->push_back(0);
+      continue;
+    }
+    // coming out of silence, the window and the spectrum the next is
+    // compared with should hold the silence, not what preceded it
+    if (gated) {
+      aubio_pvoc_do(pvoc, last_vec, grain);
+      aubio_onsetdetection(detect, grain, onset_vec);
+      gated = false;
+    }
+    aubio_pvoc_do(pvoc, in_vec, grain);
+    aubio_onsetdetection(detect, grain, onset_vec);
+    float score = 0;
+    for (int m=0; m<mixed; m++)
+      score += onset_vec->data[m][0];
+    scores->push_back(score);
+  }
+  progress.add(cur_sample & (BUF_SIZE*64-1));
+  {
+    lock_guard<mutex> guard(aubio_lock);
+    del_aubio_pvoc(pvoc);
+    del_aubio_onsetdetection(detect);
+    del_fvec(in_vec);
+    del_fvec(last_vec);
+    del_cvec(grain);
+    del_fvec(onset_vec);
   }
-  del_aubio_onset(onset);
-  del_fvec(in_vec);
-  del_fvec(onset_vec);
   sf_close(file);
+  if (cancelled)
+    throw load_cancelled();
+}
 
+static unique_ptr<audio_data> read_file(const string& path,
+                                        vector<float>* scores,
+                                        const map_options& options,
+                                        load_progress* progress)
+{
+  SF_INFO info = {0};
+  SNDFILE* file = sf_open(path.c_str(), SFM_READ, &info);
+  if (!file)
+    throw load_error(path + ": " + sf_strerror(0));
+  if (info.frames <= 0) {
+    sf_close(file);
+    throw load_error(path + ": no audio");
+  }
+  unique_ptr<audio_data> adata(new audio_data(info.frames, info.channels));
+  decode_progress decoded(progress, info.frames);
+  read_and_detect(file, info, *adata, 0, scores, options, decoded);
   return adata;
 }
 
-static void construct_edges(five_color& fc, region_map& regions, int nsize) {
-  for (auto it=regions.begin(); it != regions.end();) {
-    region r;
-    r.start = it->first;
-    five_color::vertex* v = it->second;
-    ++it;
-    r.end = it == regions.end() ? INT_MAX : it->first;
-    traverse_region(r, v, fc, regions, nsize);
+// Every file under dir, in name order, skipping hidden ones
+static void list_files(const string& dir, vector<string>& files) {
+  DIR* d = opendir(dir.c_str());
+  if (!d) return;
+  vector<string> names;
+  while (dirent* e = readdir(d))
+    if (e->d_name[0] != '.')
+      names.push_back(e->d_name);
+  closedir(d);
+  sort(names.begin(), names.end());
+  for (size_t i=0; i<names.size(); i++) {
+    string path = dir + "/" + names[i];
+    struct stat st;
+    if (stat(path.c_str(), &st))
+      continue;
+    if (S_ISDIR(st.st_mode))
+      list_files(path, files);
+    else if (S_ISREG(st.st_mode))
+      files.push_back(path);
   }
 }
 
-// TODO maybe use this elsewhere
-static int lookup_index(int nsize, bitmask_t x, bitmask_t y) {
-  bitmask_t coords[2];
-  coords[0] = x;
-  coords[1] = y;
-  return hilbert_c2i(2, nsize, coords);
+// Decode every audio file under dir, each on whichever thread is free,
+// into one timeline in name order.  sources and source_starts get each
+// file and the frame it starts at; every file starts a region.
+static unique_ptr<audio_data> read_corpus(const string& dir,
+                                          vector<string>& sources,
+                                          vector<int64_t>& source_starts,
+                                          vector<onset_candidate>& candidates,
+                                          const map_options& options,
+                                          vector<pair<int64_t,int64_t> >* silences,
+                                          load_progress* progress)
+{
+  vector<string> files;
+  list_files(dir, files);
+  vector<SF_INFO> infos;
+  int64_t frames = 0;
+  int channels = 1;
+  for (size_t i=0; i<files.size(); i++) {
+    SF_INFO info = {0};
+    SNDFILE* file = sf_open(files[i].c_str(), SFM_READ, &info);
+    if (!file)
+      continue;
+    sf_close(file);
+    if (info.frames <= 0)
+      continue;
+    sources.push_back(files[i]);
+    source_starts.push_back(frames);
+    infos.push_back(info);
+    frames += info.frames;
+    channels = max(channels, info.channels);
+  }
+  if (!frames)
+    throw load_error(dir + ": no audio files");
+
+  unique_ptr<audio_data> adata(new audio_data(frames, channels));
+  vector<vector<onset_candidate> > found(sources.size());
+  vector<vector<pair<int64_t,int64_t> > > quiet(sources.size());
+  decode_progress decoded(progress, frames);
+  atomic<bool> cancelled(false);
+  mutex failure_lock;
+  string failure; // the first file that would not read, and why
+  parallel_each(0, sources.size(), [&](int, size_t i) {
+      if (cancelled) return;
+      SF_INFO info = infos[i];
+      SNDFILE* file = sf_open(sources[i].c_str(), SFM_READ, &info);
+      try {
+        // changed since it was listed
+        if (!file)
+          throw load_error(sources[i] + ": " + sf_strerror(0));
+        if (info.frames != infos[i].frames || info.channels != infos[i].channels) {
+          sf_close(file);
+          throw load_error(sources[i] + ": changed while loading");
+        }
+        vector<float> scores;
+        read_and_detect(file, info, *adata, source_starts[i], &scores,
+                        options, decoded);
+        pick_candidates(scores, source_starts[i], found[i]);
+        if (silences)
+          find_silences(scores, source_starts[i],
+                        source_starts[i] + infos[i].frames, quiet[i]);
+      } catch (load_cancelled&) {
+        cancelled = true;
+      } catch (exception& e) {
+        lock_guard<mutex> guard(failure_lock);
+        if (failure.empty())
+          failure = e.what();
+        cancelled = true;
+      }
+    });
+  if (!failure.empty())
+    throw load_error(failure);
+  if (cancelled)
+    throw load_cancelled();
+  for (size_t i=0; i<found.size(); i++) {
+    candidates.insert(candidates.end(), found[i].begin(), found[i].end());
+    if (silences)
+      silences->insert(silences->end(), quiet[i].begin(), quiet[i].end());
+  }
+  return adata;
 }
 
-static unique_ptr<cairo_image> resample_and_draw(region_map& regions,
-                                                 audio_data& adata,
-                                                 int nsize,
-                                                 int out_size)
-{
-  grain_draw draw(regions.begin(), regions.end());
+// Lighten every pixel on the edge of the map or with a neighbour,
+// among the eight around it, in another region, as ids says.  Rows
+// are split into bands across threads; within a row, four pixels are
+// compared against their shifted neighbours and blended at a time.
+static void outline(cairo_image& img, const uint32_t* ids, int threads) {
+  const int w = img.width;
+  assert(img.height == w && img.stride == 4*w);
+  uint32_t* pixels = (uint32_t*)img.data;
+  parallel_for(threads, w, [&](int, size_t begin, size_t end) {
+      for (int y=begin; y<(int)end; y++) {
+        uint32_t* row = pixels + (size_t)y*w;
+        if (y == 0 || y == w-1) {
+          for (int x=0; x<w; x++)
+            img.mark(x, y);
+          continue;
+        }
 
-  int src_err;
-  SRC_STATE* src = src_new(SRC_SINC_FASTEST, 1, &src_err);
-  assert(src);
+        const uint32_t* up = ids + (size_t)(y-1)*w;
+        const uint32_t* mid = up + w;
+        const uint32_t* down = mid + w;
+        img.mark(0, y);
+        int x = 1;
+#ifdef __SSE2__
+        // mark()'s truncated c*0.9 + 25.5 is (9c + 255)/10, and over
+        // 0..2550 dividing by 10 is a multiply by 52429 >> 19; that
+        // gives the same pixels for every c.  mark() also clears the
+        // unused top byte.
+        const __m128i nine = _mm_set1_epi16(9);
+        const __m128i lift = _mm_set1_epi16(255);
+        const __m128i tenth = _mm_set1_epi16((short)52429);
+        const __m128i rgb = _mm_set1_epi32(0xFFFFFF);
+        const __m128i zero = _mm_setzero_si128();
+        for (; x+4 <= w-1; x += 4) {
+          __m128i c = _mm_loadu_si128((const __m128i*)(mid + x));
+          __m128i same = _mm_and_si128(
+            _mm_and_si128(
+              _mm_and_si128(_mm_cmpeq_epi32(c, _mm_loadu_si128((const __m128i*)(up + x-1))),
+                            _mm_cmpeq_epi32(c, _mm_loadu_si128((const __m128i*)(up + x)))),
+              _mm_and_si128(_mm_cmpeq_epi32(c, _mm_loadu_si128((const __m128i*)(up + x+1))),
+                            _mm_cmpeq_epi32(c, _mm_loadu_si128((const __m128i*)(mid + x-1))))),
+            _mm_and_si128(
+              _mm_and_si128(_mm_cmpeq_epi32(c, _mm_loadu_si128((const __m128i*)(mid + x+1))),
+                            _mm_cmpeq_epi32(c, _mm_loadu_si128((const __m128i*)(down + x-1)))),
+              _mm_and_si128(_mm_cmpeq_epi32(c, _mm_loadu_si128((const __m128i*)(down + x))),
+                            _mm_cmpeq_epi32(c, _mm_loadu_si128((const __m128i*)(down + x+1))))));
+          if (_mm_movemask_epi8(same) == 0xFFFF)
+            continue;
 
-  float buf[BUF_SIZE];
-  int w = 1 << nsize;
-  unique_ptr<cairo_image> img(new cairo_image(w, w));
-  env_fol env(.99);
-  SRC_DATA data;
-  data.src_ratio = out_size/(double)adata.size;
-  data.end_of_input = 0;
-  data.input_frames = BUF_SIZE;
-  data.output_frames = (int)(BUF_SIZE*data.src_ratio + BUF_SIZE);
-  unique_ptr<float[]> out(new float[data.output_frames]);
-  data.data_in = buf;
-  data.data_out = out.get();
-
-  for (int i=0; i<adata.size; i+=BUF_SIZE) {
-    int size = data.input_frames = min(adata.size-i, BUF_SIZE);
-    memset(buf, 0, sizeof(float)*size);
-    for (int chan=0; chan<adata.channels; chan++)
-      for (int j=0; j<BUF_SIZE; j++)
-        buf[j] = max(buf[j], adata.data[chan][i]);
-
-    env.process(buf, data.input_frames);
-    src_err = src_process(src, &data);
-    assert(!src_err);
-    assert(data.input_frames_used == data.input_frames);
-    draw.process(*img, nsize, out.get(), data.output_frames_gen);
-  }
-
-  bitmask_t x, y;
-  region cur_reg = {0,-1};
-  for (bitmask_t y=0; y<w; y++) {
-    for (bitmask_t x=0; x<w; x++) {
-      int index = lookup_index(nsize, x, y);
-      if (!cur_reg.contains(index)) {
-        auto it = find_vertex(regions, index);
-        // TODO clean
-        cur_reg.start = it->first;
-        ++it;
-        cur_reg.end = it == regions.end() ? INT_MAX : it->first;
+          __m128i p = _mm_loadu_si128((const __m128i*)(row + x));
+          __m128i lo = _mm_unpacklo_epi8(p, zero);
+          __m128i hi = _mm_unpackhi_epi8(p, zero);
+          lo = _mm_add_epi16(_mm_mullo_epi16(lo, nine), lift);
+          hi = _mm_add_epi16(_mm_mullo_epi16(hi, nine), lift);
+          lo = _mm_srli_epi16(_mm_mulhi_epu16(lo, tenth), 3);
+          hi = _mm_srli_epi16(_mm_mulhi_epu16(hi, tenth), 3);
+          __m128i marked = _mm_and_si128(_mm_packus_epi16(lo, hi), rgb);
+          p = _mm_or_si128(_mm_and_si128(same, p), _mm_andnot_si128(same, marked));
+          _mm_storeu_si128((__m128i*)(row + x), p);
+        }
+#endif
+        for (; x<w-1; x++) {
+          const uint32_t c = mid[x];
+          if (c != up[x-1] || c != up[x] || c != up[x+1] ||
+              c != mid[x-1] || c != mid[x+1] ||
+              c != down[x-1] || c != down[x] || c != down[x+1])
+            img.mark(x, y);
+        }
+        img.mark(w-1, y);
       }
-      if (x == 0 || x == w-1 ||
-          y == 0 || y == w-1 ||
-          !(cur_reg.contains(lookup_index(nsize, x-1, y-1)) &&
-            cur_reg.contains(lookup_index(nsize, x-1, y  )) &&
-            cur_reg.contains(lookup_index(nsize, x-1, y+1)) &&
+    });
+}
 
-            cur_reg.contains(lookup_index(nsize, x,   y-1)) &&
-            cur_reg.contains(lookup_index(nsize, x,   y+1)) &&
+// Peak of the samples under each of pixels [first, first+n), where a
+// pixel covers 2^shift indexes
+static void pixel_peaks(const audio_data& adata, const envelope& env,
+                        const sample_layout& layout, int64_t first, int64_t n,
+                        float* peaks, vector<float>& scratch, int shift = 0)
+{
+  auto begin = [&](int64_t pixel) {
+    return min(layout.sample(pixel << shift), adata.size);
+  };
+  auto end = [&](int64_t pixel) {
+    return min(max(layout.sample((pixel+1) << shift), begin(pixel)+1), adata.size);
+  };
+  auto wide = [&](int64_t pixel) {
+    return end(pixel) - begin(pixel) >= envelope::block_size;
+  };
+  const bool all_wide =
+    layout.samples_per_index()*((int64_t)1 << shift) >= envelope::block_size;
 
-            cur_reg.contains(lookup_index(nsize, x+1, y-1)) &&
-            cur_reg.contains(lookup_index(nsize, x+1, y  )) &&
-            cur_reg.contains(lookup_index(nsize, x+1, y+1))))
-        img->mark(x,y);
+  int64_t j = 0;
+  while (j < n) {
+    if (all_wide || wide(first+j)) {
+      int64_t s0 = begin(first+j);
+      peaks[j] = s0 < adata.size ? env.query(s0, end(first+j)).peak() : 0;
+      j++;
+      continue;
+    }
 
+    // runs of narrow pixels read the samples straight, all channels at
+    // once; only collapsed silences break them up
+    int64_t k = j+1;
+    while (k < n && !wide(first+k))
+      k++;
+    const int64_t base = begin(first+j);
+    const int64_t top = end(first+k-1);
+    scratch.resize(max(top-base, (int64_t)1));
+    channel_abs_max(adata, base, top, &scratch[0]);
+    for (; j<k; j++) {
+      float peak = 0;
+      for (int64_t s=begin(first+j), e=end(first+j); s<e; s++)
+        peak = max(peak, scratch[s-base]);
+      peaks[j] = peak;
     }
   }
+}
 
+template <int N>
+static unique_ptr<cairo_image> resample_and_draw(region_map& regions,
+                                                 const audio_data& adata,
+                                                 const envelope& env,
+                                                 const sample_layout& layout)
+{
+  const int64_t out_size = (int64_t)1 << 2*N;
+  const int w = 1 << N;
+  unique_ptr<cairo_image> img(new cairo_image(w, w));
+  static const shade_table shade;
+  vector<uint32_t> ids((size_t)w*w);
+  const span_painter<N> painter(*img, &ids[0], regions, shade);
+  const int64_t square_len = span_painter<N>::square_len;
+  // each pixel takes the peak of its samples; the follower decays per
+  // pixel by what it would have over those samples one at a time
+  const float decay = pow(.99, layout.samples_per_index());
+  const int threads = default_threads();
+  const int64_t window = 1 << 18;
+  vector<float> peaks(window), followed(window);
+  vector<vector<float> > scratch(threads);
+  float level = 0;
 
-  src_delete(src);
+  for (int64_t i=0; i<out_size; i+=window) {
+    const int64_t size = min(out_size-i, window);
+    parallel_for(threads, size, [&](int t, size_t begin, size_t end) {
+        pixel_peaks(adata, env, layout, i+begin, end-begin,
+                    &peaks[begin], scratch[t]);
+      });
+    level = follow_peaks(&peaks[0], &followed[0], size, decay, level, threads);
+    parallel_for(threads, size/square_len, [&](int, size_t begin, size_t end) {
+        for (size_t q=begin; q<end; q++)
+          painter.paint(i + q*square_len, &followed[q*square_len]);
+      });
+  }
 
+  outline(*img, &ids[0], threads);
   return img;
 }
 
-audio_data::audio_data(int size, int channels)
+namespace {
+  struct draw_kernel {
+    region_map& regions;
+    const audio_data& adata;
+    const envelope& env;
+    const sample_layout& layout;
+    unique_ptr<cairo_image> img;
+
+    template <int N> void run() {
+      img = resample_and_draw<N>(regions, adata, env, layout);
+    }
+  };
+
+  struct c2i_kernel {
+    bitmask_t (*c2i)(const bitmask_t coords[2]);
+    void (*i2c)(bitmask_t index, bitmask_t coords[2]);
+
+    template <int N> void run() {
+      c2i = hilbert2d_c2i<N>;
+      i2c = hilbert2d_i2c<N>;
+    }
+  };
+}
+
+audio_data::audio_data(int64_t size, int channels)
   : data(new float*[channels]),
     size(size),
     channels(channels)
@@ -391,7 +889,7 @@ cairo_image::cairo_image(int width, int height)
     width(width),
     height(height)
 {
-  int size = height*stride;
+  size_t size = (size_t)height*stride;
   data = new unsigned char[size];
 }
 
@@ -399,47 +897,458 @@ cairo_image::~cairo_image() {
   delete[] data;}
 
 void cairo_image::set(int x, int y, unsigned char r, unsigned char g, unsigned char b) {
-  *(uint32_t*)(data + y*stride + x*4) = r << 16 | g << 8 | b;
+  *(uint32_t*)(data + (size_t)y*stride + x*4) = r << 16 | g << 8 | b;
 }
 
 void cairo_image::mark(int x, int y) {
-  // TODO abstract
-  uint32_t c = *(uint32_t*)(data + y*stride + x*4);
-  unsigned char r = (c >> 16) & 0xFF;
-  unsigned char g = (c >> 8) & 0xFF;
-  unsigned char b = c & 0xFF;
-  double p = 0.10;
-  double q = 1-p;
-  set(x, y, r*q + 255*p, g*q + 255*p, b*q + 255*p);
-  //set(x, y, 255, 255, 255);
+  uint32_t* c = (uint32_t*)(data + (size_t)y*stride + x*4);
+  *c = outline_pixel(*c);
 }
 
 Cairo::RefPtr<Cairo::ImageSurface> cairo_image::create_surface() {
   return Cairo::ImageSurface::create(data, Cairo::FORMAT_RGB24, width, height, stride);
 }
 
-grainmap::grainmap(const std::string& path) {
-  int out_size = 1 << nsize;
-  out_size = out_size*out_size;
+// Everything a load works out beyond the samples themselves, as kept
+// in map_options::cache_dir.  A cache file is tied to the source's size
+// and modification time and the silence gate its scores were found
+// with; the regions and outlines are only good for the nsize,
+// threshold and layout they were made with, the scores for any.
+struct map_analysis {
+  int nsize;
+  float threshold;
+  bool collapsed;
+  vector<float> scores;
+  region_table regions;
+  region_outlines outlines;
+};
+
+static const char cache_magic[4] = {'G', 'M', 'A', 'C'};
+static const int32_t cache_version = 5;
+
+struct cache_header {
+  char magic[4];
+  int32_t version;
+  int64_t file_size, file_mtime;
+  int32_t nsize;
+  float threshold, silence_db;
+  int32_t collapsed, mix;
+  uint64_t mix_channels;
+};
+
+struct cached_region {
+  int64_t index, sample;
+  int32_t color;
+};
+
+template <class T>
+static void write_vector(FILE* f, const vector<T>& v) {
+  uint64_t n = v.size();
+  fwrite(&n, sizeof n, 1, f);
+  fwrite(v.data(), sizeof(T), n, f);
+}
+
+template <class T>
+static bool read_vector(FILE* f, vector<T>& v) {
+  uint64_t n;
+  if (fread(&n, sizeof n, 1, f) != 1 || n > (1ull << 40)/sizeof(T))
+    return false;
+  v.resize(n);
+  return fread(v.data(), sizeof(T), n, f) == n;
+}
+
+static string cache_path(const string& dir, const string& path) {
+  char* real = realpath(path.c_str(), 0);
+  string key = real ? real : path;
+  free(real);
+  char name[32];
+  snprintf(name, sizeof name, "%016zx.gmap", hash<string>()(key));
+  return dir + "/" + name;
+}
+
+// Read a header from f and check it describes the file st is about,
+// analyzed as options say
+static bool read_header(FILE* f, const struct stat& st,
+                        const map_options& options, cache_header& h)
+{
+  return fread(&h, sizeof h, 1, f) == 1 &&
+    !memcmp(h.magic, cache_magic, sizeof h.magic) &&
+    h.version == cache_version &&
+    h.file_size == st.st_size && h.file_mtime == st.st_mtime &&
+    h.silence_db == options.silence_db && h.mix == options.mix &&
+    (options.mix != mix_subset || h.mix_channels == options.mix_channels);
+}
+
+static bool read_cache(const string& file, const struct stat& st,
+                       const map_options& options, map_analysis& analysis)
+{
+  FILE* f = fopen(file.c_str(), "rb");
+  if (!f) return false;
+  cache_header h;
+  vector<cached_region> regions;
+  bool ok = read_header(f, st, options, h) &&
+    read_vector(f, analysis.scores) &&
+    read_vector(f, regions) &&
+    read_vector(f, analysis.outlines.starts) &&
+    read_vector(f, analysis.outlines.offsets) &&
+    read_vector(f, analysis.outlines.points) &&
+    read_vector(f, analysis.outlines.lo) &&
+    read_vector(f, analysis.outlines.hi);
+  fclose(f);
+  if (!ok) return false;
+
+  analysis.nsize = h.nsize;
+  analysis.threshold = h.threshold;
+  analysis.collapsed = h.collapsed;
+  auto ins = analysis.regions.begin();
+  for (size_t i=0; i<regions.size(); i++) {
+    region_start r = {regions[i].sample, regions[i].color};
+    ins = analysis.regions.insert(ins, region_table::value_type(regions[i].index, r));
+  }
+  return true;
+}
+
+// Written beside the final name and renamed over it, so concurrent
+// loads never see half a file
+static void write_cache(const string& file, const struct stat& st,
+                        int nsize, const map_options& options,
+                        const vector<float>& scores,
+                        const region_table& regions,
+                        const region_outlines& outlines)
+{
+  // a name of its own, since other threads may be writing file too
+  string tmp = file + ".XXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd < 0) return;
+  FILE* f = fdopen(fd, "wb");
+  if (!f) {
+    close(fd);
+    remove(tmp.c_str());
+    return;
+  }
+  cache_header h = {{0}, cache_version, st.st_size, st.st_mtime, nsize,
+                    options.threshold, options.silence_db,
+                    options.collapse_silence, options.mix, options.mix_channels};
+  memcpy(h.magic, cache_magic, sizeof h.magic);
+  vector<cached_region> flat;
+  flat.reserve(regions.size());
+  for (auto it=regions.begin(); it!=regions.end(); ++it) {
+    cached_region r = {it->first, it->second.sample, it->second.color};
+    flat.push_back(r);
+  }
+  fwrite(&h, sizeof h, 1, f);
+  write_vector(f, scores);
+  write_vector(f, flat);
+  write_vector(f, outlines.starts);
+  write_vector(f, outlines.offsets);
+  write_vector(f, outlines.points);
+  write_vector(f, outlines.lo);
+  write_vector(f, outlines.hi);
+  bool ok = !ferror(f);
+  ok = !fclose(f) && ok;
+  if (!ok || rename(tmp.c_str(), file.c_str()))
+    remove(tmp.c_str());
+}
+
+static bool make_dir(const string& dir) {
+  return !mkdir(dir.c_str(), 0755) || errno == EEXIST;
+}
+
+bool parse_mix(const string& spec, map_options& options) {
+  if (spec == "all") {
+    options.mix = mix_all;
+  } else if (spec == "mono") {
+    options.mix = mix_mono;
+  } else if (spec == "loudest") {
+    options.mix = mix_loudest;
+  } else if (spec == "ms") {
+    options.mix = mix_mid_side;
+  } else {
+    uint64_t channels = 0;
+    const char* p = spec.c_str();
+    for (;;) {
+      char* end;
+      long c = strtol(p, &end, 10);
+      if (end == p || c < 0 || c >= 64)
+        return false;
+      channels |= (uint64_t)1 << c;
+      if (!*end)
+        break;
+      if (*end != ',')
+        return false;
+      p = end + 1;
+    }
+    options.mix = mix_subset;
+    options.mix_channels = channels;
+  }
+  return true;
+}
+
+string default_cache_dir() {
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  string base;
+  if (xdg && *xdg)
+    base = xdg;
+  else if (home && *home)
+    base = string(home) + "/.cache";
+  else
+    return "";
+  if (!make_dir(base) || !make_dir(base + "/grainmap"))
+    return "";
+  return base + "/grainmap";
+}
+
+bool grainmap::analysis_cached(const string& path, const map_options& options) {
+  struct stat st;
+  if (options.cache_dir.empty() || stat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+    return false;
+  FILE* f = fopen(cache_path(options.cache_dir, path).c_str(), "rb");
+  if (!f) return false;
+  cache_header h;
+  bool ok = read_header(f, st, options, h);
+  fclose(f);
+  return ok;
+}
+
+// rough share of a load's time each stage takes
+static const float stage_weight[load_stages] = {0.6, 0.05, 0.2, 0.1, 0.05};
+
+static double stage_start(int stage) {
+  double start = 0;
+  for (int i=0; i<stage; i++)
+    start += stage_weight[i];
+  return start;
+}
+
+load_progress::load_progress() : done(0), stop(false), cur(load_decode) {}
+
+void load_progress::enter(load_stage stage) {
+  cur = stage;
+  done = stage_start(stage);
+}
+
+void load_progress::advance(double fraction) {
+  done = stage_start(cur) + stage_weight[cur]*min(fraction, 1.0);
+}
+
+double load_progress::fraction() const {
+  return done;
+}
+
+void load_progress::cancel() {
+  stop = true;
+}
+
+bool load_progress::cancelled() const {
+  return stop;
+}
+
+static void enter_stage(load_progress* progress, load_stage stage) {
+  if (!progress) return;
+  if (progress->cancelled())
+    throw load_cancelled();
+  progress->enter(stage);
+}
+
+int grainmap::pick_nsize(int64_t frames, size_t memory_budget, bool draw_image) {
+  // Aim for about a millisecond of audio per pixel, but never go below
+  // the resolution short files have always had, and keep the image
+  // inside the budget.
+  const int64_t samples_per_pixel = 64;
+  int limit = draw_image ? max_surface_nsize : max_nsize;
+  int nsize = default_nsize;
+  while (nsize < limit &&
+         (int64_t)1 << 2*nsize < frames/samples_per_pixel &&
+         (!draw_image ||
+          (size_t)bytes_per_pixel << 2*(nsize+1) <= memory_budget))
+    nsize++;
+  return nsize;
+}
+
+grainmap::grainmap(const std::string& path, five_color* shared_fc,
+                   const map_options& options, load_progress* progress)
+{
   region_map regions;
-  five_color fc;
+  vector<pair<int64_t,int64_t> > silences;
+  five_color local_fc;
+  five_color& fc = shared_fc ? *shared_fc : local_fc;
+
+  // analyses of single files are cached; a corpus is read afresh
+  struct stat st;
+  const bool found = !stat(path.c_str(), &st);
+  const bool corpus = found && S_ISDIR(st.st_mode);
+  string cache;
+  map_analysis cached;
+  bool hit = false;
+  if (found && !corpus && !options.cache_dir.empty()) {
+    cache = cache_path(options.cache_dir, path);
+    hit = read_cache(cache, st, options, cached);
+  }
+
   // printf("## reading\n");
-  adata = read_and_detect(path, region_starts, out_size);
-  for (auto it=region_starts.begin(); it!=region_starts.end(); ++it)
-    regions.insert(region_map::value_type(it->first, fc.create_vertex()));
-  // printf("## constructing edges\n");
-  construct_edges(fc, regions, nsize);
-  // printf("## coloring\n");
-  fc.color();
-  // printf("## drawing\n");
-  cimg = resample_and_draw(regions, *adata, nsize, out_size);
-  img = cimg->create_surface();
+  enter_stage(progress, load_decode);
+  if (corpus) {
+    adata = read_corpus(path, sources, source_starts, candidates, options,
+                        options.collapse_silence ? &silences : 0, progress);
+  } else {
+    // a hit has the scores already, which is all the detection is for
+    adata = read_file(path, hit ? 0 : &cached.scores, options, progress);
+    pick_candidates(cached.scores, 0, candidates);
+    if (options.collapse_silence)
+      find_silences(cached.scores, 0, adata->size, silences);
+    sources.push_back(path);
+    source_starts.push_back(0);
+  }
+  by_strength.resize(candidates.size());
+  for (size_t i=0; i<candidates.size(); i++)
+    by_strength[i] = i;
+  sort(by_strength.begin(), by_strength.end(), [&](uint32_t a, uint32_t b) {
+      return candidates[a].strength < candidates[b].strength;
+    });
+  threshold = options.threshold;
+  edit_count = 0;
+  enter_stage(progress, load_envelope);
+  env.reset(new envelope(*adata));
+
+  // collapsed silences need next to no room
+  nsize = options.nsize ? options.nsize :
+    pick_nsize(sample_layout::weighed(adata->size, silences),
+               options.memory_budget, options.draw_image);
+  assert(nsize >= min_nsize && nsize <= max_nsize);
+  layout = sample_layout(adata->size, (int64_t)1 << 2*nsize, silences);
+
+  if (hit && cached.nsize == nsize && cached.threshold == threshold &&
+      cached.collapsed == options.collapse_silence) {
+    region_starts.swap(cached.regions);
+    outlines.assign(cached.outlines);
+    if (options.draw_image) {
+      fc.reset();
+      fc.reserve(region_starts.size(), 0);
+      for (auto it=region_starts.begin(); it!=region_starts.end(); ++it) {
+        five_color::vertex* v = fc.create_vertex();
+        v->color = it->second.color;
+        regions.insert(regions.end(), region_map::value_type(it->first, v));
+      }
+    }
+  } else {
+    // where several candidates land on one index, the earliest wins
+    auto ins = region_starts.begin();
+    for (size_t i=0; i<candidates.size(); i++) {
+      // files always start regions, whatever the threshold
+      if (candidates[i].strength <= threshold &&
+          candidates[i].strength != INFINITY)
+        continue;
+      region_start r = {candidates[i].sample, 0};
+      ins = region_starts.insert(ins, region_table::value_type(
+                                   region_index(candidates[i].sample), r));
+    }
+
+    // region graphs are planar, so there are fewer than 6 directed
+    // edges per region
+    enter_stage(progress, load_regions);
+    fc.reset();
+    fc.reserve(region_starts.size(), 6*region_starts.size());
+    for (auto it=region_starts.begin(); it!=region_starts.end(); ++it)
+      regions.insert(region_map::value_type(it->first, fc.create_vertex()));
+    // printf("## constructing edges\n");
+    region_outlines flat;
+    construct_edges(fc, regions, nsize, &flat);
+    outlines.assign(flat);
+    // printf("## coloring\n");
+    enter_stage(progress, load_color);
+    fc.color_fast();
+    auto reg = regions.begin();
+    for (auto it=region_starts.begin(); it!=region_starts.end(); ++it, ++reg)
+      it->second.color = reg->second->color;
+
+    if (!cache.empty())
+      write_cache(cache, st, nsize, options, cached.scores, region_starts,
+                  flat);
+  }
+
+  enter_stage(progress, load_draw);
+  if (options.draw_image && nsize <= max_surface_nsize) {
+    // printf("## drawing\n");
+    draw(regions);
+  }
+  c2i_kernel lookup = {0, 0};
+  with_nsize(nsize, lookup);
+  c2i = lookup.c2i;
+  i2c = lookup.i2c;
+  if (progress)
+    progress->enter(load_stages);
   // printf("## writing\n");
   // cairo_surface_t* surface = img->create_surface();
   // img->write_to_png("bin/out.png");
   // cairo_surface_destroy(surface)
 }
 
+int64_t grainmap::region_index(int64_t sample) const {
+  return max(layout.index(sample), (int64_t)0);
+}
+
+void grainmap::draw(region_map& regions) {
+  draw_kernel k = {regions, *adata, *env, layout};
+  with_nsize(nsize, k);
+  cimg = move(k.img);
+  img = cimg->create_surface();
+}
+
+sample_layout::sample_layout(int64_t frames, int64_t size,
+                             const vector<pair<int64_t,int64_t> >& silences)
+{
+  const double scale = size/(double)weighed(frames, silences);
+  density = 1/scale;
+  samples.push_back(0);
+  indexes.push_back(0);
+  // knots too close to the last to get an index of their own are
+  // dropped
+  auto knot = [&](int64_t sample, double at) {
+    int64_t index = (int64_t)(at*scale);
+    if (sample > samples.back() && index > indexes.back() && index < size) {
+      samples.push_back(sample);
+      indexes.push_back(index);
+    }
+  };
+  double at = 0;
+  int64_t last = 0;
+  for (size_t i=0; i<silences.size(); i++) {
+    at += silences[i].first - last;
+    knot(silences[i].first, at);
+    at += (silences[i].second - silences[i].first)/(double)squeeze;
+    knot(silences[i].second, at);
+    last = silences[i].second;
+  }
+  samples.push_back(frames);
+  indexes.push_back(size);
+  for (size_t k=0; k+1<samples.size(); k++) {
+    ratios.push_back((indexes[k+1] - indexes[k])/(double)(samples[k+1] - samples[k]));
+    inverses.push_back((samples[k+1] - samples[k])/(double)(indexes[k+1] - indexes[k]));
+  }
+}
+
+int64_t sample_layout::index(int64_t sample) const {
+  size_t k = upper_bound(samples.begin(), samples.end() - 1, sample) - samples.begin();
+  k = k ? k-1 : 0;
+  return indexes[k] + (int64_t)((sample - samples[k])*ratios[k]);
+}
+
+int64_t sample_layout::sample(int64_t index) const {
+  size_t k = upper_bound(indexes.begin(), indexes.end() - 1, index) - indexes.begin();
+  k = k ? k-1 : 0;
+  return samples[k] + (int64_t)((index - indexes[k])*inverses[k]);
+}
+
+int64_t sample_layout::weighed(int64_t frames,
+                               const vector<pair<int64_t,int64_t> >& silences)
+{
+  int64_t silent = 0;
+  for (size_t i=0; i<silences.size(); i++)
+    silent += silences[i].second - silences[i].first;
+  return frames - silent + silent/squeeze;
+}
+
 float** grainmap::get_audio() {
   return adata->data;
 }
@@ -449,26 +1358,432 @@ int grainmap::channel_count() {
 }
 
 // start and end are samples; starti, endi are hilbert indexes
-void grainmap::lookup(int x, int y, int& start, int& stop, int& starti, int& endi) {
+void grainmap::lookup(int x, int y, int64_t& start, int64_t& stop,
+                      int64_t& starti, int64_t& endi)
+{
   // TODO merge with find_vertex
   bitmask_t coords[2];
   coords[0] = x;
   coords[1] = y;
-  int index = hilbert_c2i(2, nsize, coords);
+  int64_t index = c2i(coords);
   assert(index >= 0);
   if (index >= starti && index < endi)
     return;
   auto it = --region_starts.upper_bound(index);
   starti = it->first;
-  start = it->second;
+  start = it->second.sample;
   assert(start >= 0);
   ++it;
   // TODO this sort of thing appears in several places
-  endi = it == region_starts.end() ? INT_MAX : it->first;
-  stop = it == region_starts.end() ? adata->size : it->second;
+  endi = it == region_starts.end() ? INT64_MAX : it->first;
+  stop = it == region_starts.end() ? adata->size : it->second.sample;
+}
+
+bool grainmap::try_lookup(int x, int y, int64_t& start, int64_t& stop,
+                          int64_t& starti, int64_t& endi, unsigned& edits)
+{
+  unique_lock<mutex> guard(edit_lock, try_to_lock);
+  if (!guard.owns_lock())
+    return false;
+  if (edits != edit_count) {
+    edits = edit_count;
+    starti = endi = -1;
+  }
+  lookup(x, y, start, stop, starti, endi);
+  return true;
+}
+
+unsigned grainmap::edits() const {
+  return edit_count;
+}
+
+int64_t grainmap::sample_index(int64_t sample, int64_t start, int64_t stop,
+                               int64_t starti, int64_t endi) const
+{
+  endi = min(endi, (int64_t)1 << 2*nsize);
+  return max(min(layout.index(sample), endi - 1), starti);
+}
+
+void grainmap::coords(int64_t index, int& x, int& y) const {
+  bitmask_t c[2];
+  i2c(index, c);
+  x = c[0];
+  y = c[1];
+}
+
+int64_t grainmap::index(int x, int y) const {
+  bitmask_t c[2];
+  c[0] = x;
+  c[1] = y;
+  return c2i(c);
 }
 
 Cairo::RefPtr<Cairo::ImageSurface> grainmap::get_surface() {
   return img;
 }
 
+int grainmap::get_nsize() const {
+  return nsize;
+}
+
+size_t grainmap::memory_size() const {
+  size_t size = (size_t)adata->size*adata->channels*sizeof(float) +
+    env->memory_size() +
+    region_starts.size()*(sizeof(region_table::value_type) + 4*sizeof(void*)) +
+    outlines.points()*sizeof(outline_point) +
+    outlines.size()*(sizeof(outline_table::outline) + 6*sizeof(void*));
+  if (cimg)
+    size += (size_t)cimg->height*cimg->stride;
+  return size;
+}
+
+const vector<string>& grainmap::get_sources() const {
+  return sources;
+}
+
+void grainmap::locate_sample(int64_t sample, int& source, int64_t& offset) const {
+  source = upper_bound(source_starts.begin(), source_starts.end(), sample) -
+    source_starts.begin() - 1;
+  offset = sample - source_starts[source];
+}
+
+int64_t grainmap::frame_count() const {
+  return adata->size;
+}
+
+const sample_layout& grainmap::get_layout() const {
+  return layout;
+}
+
+const region_table& grainmap::get_regions() const {
+  return region_starts;
+}
+
+const envelope& grainmap::get_envelope() const {
+  return *env;
+}
+
+void grainmap::followed_peaks(int level, int64_t first, int64_t n,
+                              float* out) const {
+  const int shift = 2*level;
+  const float decay = pow(.99, layout.samples_per_index()*((int64_t)1 << shift));
+  // the follower forgets all but 1/65536 of where it was after warm
+  // pixels, as close as the drawn image's own follower settles
+  int64_t warm = first;
+  if (decay < 1)
+    warm = min(warm, (int64_t)ceil(log(1.0/65536)/log(max(decay, 1e-30f))));
+  vector<float> peaks(warm + n), followed(warm + n), scratch;
+  pixel_peaks(*adata, *env, layout, first - warm, warm + n, &peaks[0],
+              scratch, shift);
+  follow_peaks(&peaks[0], &followed[0], warm + n, decay, 0, 1);
+  copy(followed.begin() + warm, followed.end(), out);
+}
+
+const outline_table& grainmap::get_outlines() const {
+  return outlines;
+}
+
+float grainmap::get_threshold() const {
+  return threshold;
+}
+
+namespace {
+  // A region_table as the graph kempe::recolor() works on.  Vertices
+  // get ids as they are first reached, and their neighbours are found
+  // by walking their boundaries then, so a recoloring only looks at
+  // the regions it reaches.  Regions whose color changes are added to
+  // changed.
+  class table_graph {
+    region_table& regions;
+    int nsize;
+    vector<int64_t>& changed;
+    map<int64_t,int> ids;
+    vector<region_table::iterator> vertices;
+    vector<vector<int> > adjacent;
+    vector<bool> walked;
+    vector<int64_t> found;
+
+  public:
+    table_graph(region_table& regions, int nsize, vector<int64_t>& changed)
+      : regions(regions), nsize(nsize), changed(changed) {}
+
+    int id(int64_t start) {
+      auto ins = ids.insert(make_pair(start, (int)vertices.size()));
+      if (ins.second) {
+        vertices.push_back(regions.find(start));
+        assert(vertices.back() != regions.end());
+        adjacent.push_back(vector<int>());
+        walked.push_back(false);
+      }
+      return ins.first->second;
+    }
+
+    size_t size() const { return vertices.size(); }
+    int color(int v) const { return vertices[v]->second.color; }
+
+    void set_color(int v, int c) {
+      vertices[v]->second.color = c;
+      changed.push_back(vertices[v]->first);
+    }
+
+    template <class F> void neighbours(int v, F f) {
+      if (!walked[v]) {
+        found.clear();
+        region_neighbours(regions, vertices[v]->first, nsize, found);
+        sort(found.begin(), found.end());
+        found.erase(unique(found.begin(), found.end()), found.end());
+        for (size_t i=0; i<found.size(); i++) {
+          int u = id(found[i]);
+          adjacent[v].push_back(u);
+        }
+        walked[v] = true;
+      }
+      for (size_t i=0; i<adjacent[v].size(); i++)
+        f(adjacent[v][i]);
+    }
+  };
+}
+
+// Start a region at index, splitting the one it falls in
+void grainmap::add_boundary(int64_t index, int64_t sample,
+                            vector<int64_t>& touched)
+{
+  auto prev = --region_starts.upper_bound(index);
+  assert(prev->first < index);
+  region_start r = {sample, -1};
+  region_starts.insert(next(prev), region_table::value_type(index, r));
+  touched.push_back(prev->first);
+  touched.push_back(index);
+}
+
+// Merge the region starting at index into the one before it
+void grainmap::remove_boundary(int64_t index, vector<int64_t>& touched) {
+  auto it = region_starts.find(index);
+  assert(it != region_starts.end() && it != region_starts.begin());
+  touched.push_back(prev(it)->first);
+  region_starts.erase(it);
+}
+
+// Only the touched regions' outlines change.  Each takes the place of
+// the old outlines that started within its new extent.
+void grainmap::outline_again(const vector<int64_t>& touched) {
+  region_outlines one;
+  for (size_t t=0; t<touched.size(); t++) {
+    auto it = region_starts.find(touched[t]), after = next(it);
+    const int64_t end = after == region_starts.end() ? INT64_MAX : after->first;
+    one.clear();
+    append_outline(region_starts, it->first, nsize, one);
+    outlines.replace(it->first, end, one);
+  }
+}
+
+// Recolor and outline the touched regions again after their extents
+// changed, and redraw the image if there is one
+void grainmap::repair(vector<int64_t>& touched, vector<int64_t>& changed) {
+  // regions merged away since they were touched are gone
+  sort(touched.begin(), touched.end());
+  touched.erase(unique(touched.begin(), touched.end()), touched.end());
+  touched.erase(remove_if(touched.begin(), touched.end(), [&](int64_t start) {
+        return !region_starts.count(start);
+      }), touched.end());
+  changed = touched;
+
+  // New regions have no color yet; old ones may now border one of
+  // their own.  Uncolor both, then give each a color Kempe's way.
+  table_graph g(region_starts, nsize, changed);
+  vector<int> pending;
+  for (size_t i=0; i<touched.size(); i++) {
+    int v = g.id(touched[i]);
+    bool clash = g.color(v) < 0;
+    g.neighbours(v, [&](int u) {
+        if (g.color(u) == g.color(v))
+          clash = true;
+      });
+    if (clash)
+      pending.push_back(v);
+  }
+  for (size_t i=0; i<pending.size(); i++)
+    g.set_color(pending[i], -1);
+  // Kempe chains can fail a region with more than five neighbours; then
+  // the neighbours give up their colors to it and take new ones.
+  kempe chains;
+  bool colored = true;
+  vector<int> around;
+  for (size_t i=0; i<pending.size() && colored; i++) {
+    const int v = pending[i];
+    if (chains.recolor(g, v))
+      continue;
+    around.clear();
+    g.neighbours(v, [&](int u) {
+        around.push_back(u);
+      });
+    for (size_t j=0; j<around.size(); j++)
+      g.set_color(around[j], -1);
+    colored = chains.recolor(g, v);
+    for (size_t j=0; j<around.size() && colored; j++)
+      colored = chains.recolor(g, around[j]);
+  }
+  if (!colored) {
+    // color the whole map over
+    five_color fc;
+    region_map regions;
+    fc.reserve(region_starts.size(), 6*region_starts.size());
+    for (auto it=region_starts.begin(); it!=region_starts.end(); ++it)
+      regions.insert(regions.end(), region_map::value_type(it->first, fc.create_vertex()));
+    construct_edges(fc, regions, nsize);
+    fc.color_fast();
+    auto reg = regions.begin();
+    for (auto it=region_starts.begin(); it!=region_starts.end(); ++it, ++reg) {
+      if (it->second.color != reg->second->color)
+        changed.push_back(it->first);
+      it->second.color = reg->second->color;
+    }
+  }
+  sort(changed.begin(), changed.end());
+  changed.erase(unique(changed.begin(), changed.end()), changed.end());
+
+  outline_again(touched);
+
+  if (cimg) {
+    five_color fc;
+    region_map regions;
+    fc.reserve(region_starts.size(), 0);
+    for (auto it=region_starts.begin(); it!=region_starts.end(); ++it) {
+      five_color::vertex* v = fc.create_vertex();
+      v->color = it->second.color;
+      regions.insert(regions.end(), region_map::value_type(it->first, v));
+    }
+    draw(regions);
+  }
+}
+
+bool grainmap::split(int64_t index, vector<int64_t>& changed) {
+  changed.clear();
+  lock_guard<mutex> guard(edit_lock);
+  assert(index >= 0 && index < (int64_t)1 << 2*nsize);
+  auto it = --region_starts.upper_bound(index), after = next(it);
+  if (it->first == index)
+    return false;
+  const int64_t stop = after == region_starts.end() ? adata->size : after->second.sample;
+  const int64_t start = it->second.sample;
+  if (stop - start < 2)
+    return false;
+  const int64_t sample = layout.sample(index);
+  vector<int64_t> touched;
+  add_boundary(index, min(max(sample, start + 1), stop - 1), touched);
+  repair(touched, changed);
+  edit_count++;
+  return true;
+}
+
+bool grainmap::merge(int64_t index, vector<int64_t>& changed) {
+  changed.clear();
+  lock_guard<mutex> guard(edit_lock);
+  auto it = --region_starts.upper_bound(index);
+  if (it == region_starts.begin())
+    return false;
+  vector<int64_t> touched;
+  remove_boundary(it->first, touched);
+  repair(touched, changed);
+  edit_count++;
+  return true;
+}
+
+void grainmap::set_threshold(float t, vector<int64_t>& changed) {
+  changed.clear();
+  lock_guard<mutex> guard(edit_lock);
+  float strongest = min_threshold;
+  for (auto it=by_strength.rbegin(); it!=by_strength.rend(); ++it) {
+    if (candidates[*it].strength != INFINITY) {
+      strongest = max(strongest, candidates[*it].strength);
+      break;
+    }
+  }
+  if (!(t >= min_threshold))
+    t = min_threshold;
+  t = min(t, strongest);
+  const float lo = min(t, threshold), hi = max(t, threshold);
+  threshold = t;
+
+  // the candidates that switch on or off, as the indexes they land on
+  auto weaker = [&](float s, uint32_t i) {
+    return s < candidates[i].strength;
+  };
+  auto first = upper_bound(by_strength.begin(), by_strength.end(), lo, weaker);
+  auto last = upper_bound(by_strength.begin(), by_strength.end(), hi, weaker);
+  vector<int64_t> places;
+  for (auto it=first; it!=last; ++it)
+    places.push_back(region_index(candidates[*it].sample));
+  sort(places.begin(), places.end());
+  places.erase(unique(places.begin(), places.end()), places.end());
+
+  // each place starts a region from its earliest active candidate, if
+  // it has any
+  vector<int64_t> touched;
+  bool moved = false;
+  for (size_t i=0; i<places.size(); i++) {
+    const int64_t place = places[i];
+    auto c = lower_bound(candidates.begin(), candidates.end(), place,
+                         [&](const onset_candidate& a, int64_t place) {
+                           return region_index(a.sample) < place;
+                         });
+    while (c != candidates.end() && region_index(c->sample) == place &&
+           c->strength <= threshold)
+      ++c;
+    const bool active = c != candidates.end() && region_index(c->sample) == place;
+    auto r = region_starts.find(place);
+    if (active && r == region_starts.end()) {
+      add_boundary(place, c->sample, touched);
+    } else if (!active && r != region_starts.end()) {
+      remove_boundary(place, touched);
+    } else if (active && r->second.sample != c->sample) {
+      r->second.sample = c->sample;
+      moved = true;
+    }
+  }
+  if (touched.empty() && !moved)
+    return;
+  repair(touched, changed);
+  edit_count++;
+}
+
+grainmap_loader::grainmap_loader(const std::string& path,
+                                 const map_options& options,
+                                 const done_function& done)
+  : worker(&grainmap_loader::run, this,
+           [path, options](load_progress& progress) {
+             return shared_ptr<grainmap>(new grainmap(path, 0, options, &progress));
+           }, done)
+{
+}
+
+grainmap_loader::grainmap_loader(const load_function& load,
+                                 const done_function& done)
+  : worker(&grainmap_loader::run, this, load, done)
+{
+}
+
+void grainmap_loader::run(const load_function& load, const done_function& done) {
+  shared_ptr<grainmap> map;
+  string error;
+  try {
+    map = load(progress);
+  } catch (load_cancelled&) {
+  } catch (exception& e) {
+    error = e.what();
+  }
+  done(map, error);
+}
+
+grainmap_loader::~grainmap_loader() {
+  cancel();
+  worker.join();
+}
+
+void grainmap_loader::cancel() {
+  progress.cancel();
+}
+
+double grainmap_loader::fraction() const {
+  return progress.fraction();
+}
@@ -24,13 +24,24 @@
 #include <cairomm/cairomm.h>
 #include <memory>
 #include <map>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <stdexcept>
+#include <stdint.h>
+#include "hilbert.h"
+#include "envelope.h"
+#include "region-graph.h"
 
 struct audio_data {
   float** data;
-  int size;
+  int64_t size;
   int channels;
 
-  audio_data(int size, int channels);
+  audio_data(int64_t size, int channels);
   ~audio_data();
 };
 
@@ -46,20 +57,266 @@ struct cairo_image {
   Cairo::RefPtr<Cairo::ImageSurface> create_surface();
 };
 
+class five_color;
+
+// RGB of each of the five region colors
+extern const float map_colors[5][3];
+
+// A pixel of a region of color whose followed peak is level, as the
+// drawn image and the tiles both paint it
+uint32_t shade_pixel(int color, float level);
+// pixel lightened, as on a region's outline
+uint32_t outline_pixel(uint32_t pixel);
+
+// What onsets are looked for in.  Detection costs in proportion to the
+// channels it is given, so many-channel recordings go faster mixed
+// down.
+enum analysis_mix {
+  mix_all,      // every channel, each on its own
+  mix_mono,     // the mean of them all
+  mix_loudest,  // whichever has the most power, hop by hop
+  mix_mid_side, // (L+R)/2 and (L-R)/2 of the first two
+  mix_subset    // just those in map_options::mix_channels
+};
+
+struct map_options {
+  int nsize;            // map is 2^nsize pixels square; 0 picks one
+  size_t memory_budget; // bytes the pixel layers may take
+  bool draw_image;      // render the whole map up front for get_surface()
+  std::string cache_dir; // keep analyses here, unless empty
+  float threshold;      // onset candidates stronger than this start regions
+  float silence_db;     // quieter stretches are not searched for onsets
+  bool collapse_silence; // and, if this is set, take next to no room
+  analysis_mix mix;
+  uint64_t mix_channels; // for mix_subset, bit c picks channel c
+
+  map_options()
+    : nsize(0), memory_budget(256 << 20), draw_image(true), threshold(0.3),
+      silence_db(-60), collapse_silence(false), mix(mix_all),
+      mix_channels(1) {}
+};
+
+// Which samples each hilbert index stands for: piecewise linear, with
+// long silences squeezed into a small share of the indexes if the map
+// collapses them, else in proportion throughout.
+class sample_layout {
+  // knots, both increasing, from (0, 0) to (frames, size)
+  std::vector<int64_t> samples, indexes;
+  // indexes per sample after each knot, and samples per index
+  std::vector<double> ratios, inverses;
+  double density;
+
+public:
+  // a silence's samples take 1/squeeze of the room others do
+  static const int squeeze = 256;
+
+  sample_layout() : density(1) {}
+  // silences, if any, are sorted and disjoint (start, end) pairs
+  sample_layout(int64_t frames, int64_t size,
+                const std::vector<std::pair<int64_t,int64_t> >& silences =
+                std::vector<std::pair<int64_t,int64_t> >());
+
+  // the index sample falls on
+  int64_t index(int64_t sample) const;
+  // the first sample index stands for
+  int64_t sample(int64_t index) const;
+  // samples per index outside the silences
+  double samples_per_index() const { return density; }
+
+  // the frames a map of frames with these silences takes as much room
+  // as, laid out by sample_layout
+  static int64_t weighed(int64_t frames,
+                         const std::vector<std::pair<int64_t,int64_t> >& silences);
+};
+
+// A place a region could start: the peaks of the onset detection
+// function, with how far each stands out.  Each source's first sample
+// is one, infinitely strong.
+struct onset_candidate {
+  int64_t sample;
+  float strength;
+};
+
+// Set options' mix from spec: all, mono, loudest, ms, or a comma
+// separated list of channels counted from 0; false if it is none of
+// those
+bool parse_mix(const std::string& spec, map_options& options);
+
+// $XDG_CACHE_HOME/grainmap or ~/.cache/grainmap, created if need be;
+// empty if neither can be
+std::string default_cache_dir();
+
+// The steps of a load, in order
+enum load_stage {
+  load_decode,   // reading the file and detecting onsets
+  load_envelope,
+  load_regions,  // region graph and outlines
+  load_color,
+  load_draw,
+  load_stages
+};
+
+// Shared between a load and whoever waits on it: the load reports how
+// far it has got, weighting each stage by its usual share of the time,
+// and stops at its next check once cancelled
+class load_progress {
+  std::atomic<float> done;
+  std::atomic<bool> stop;
+  load_stage cur;
+
+public:
+  load_progress();
+  void enter(load_stage stage);
+  // fraction of the current stage finished
+  void advance(double fraction);
+  double fraction() const;
+  void cancel();
+  bool cancelled() const;
+};
+
+// thrown out of a load whose load_progress was cancelled
+struct load_cancelled {};
+
+// thrown out of a load when there is no audio to be had from path
+struct load_error : std::runtime_error {
+  explicit load_error(const std::string& what) : std::runtime_error(what) {}
+};
+
 class grainmap {
-  static const int nsize = 10;
+  static const int default_nsize = 10;
+  // cairo image surfaces are at most 32767 pixels on a side
+  static const int max_surface_nsize = 14;
+  // the image and the region raster its outlines come from
+  static const int bytes_per_pixel = 8;
 
-  std::map<int,int> region_starts; // (index -> sample) TODO merge with region_map
+  int nsize;
+  bitmask_t (*c2i)(const bitmask_t coords[2]);
+  void (*i2c)(bitmask_t index, bitmask_t coords[2]);
+  region_table region_starts; // TODO merge with region_map
   std::unique_ptr<audio_data> adata;
+  std::unique_ptr<envelope> env;
+  outline_table outlines;
+  std::vector<std::string> sources;    // files, in timeline order
+  std::vector<int64_t> source_starts; // frame each source starts at
+  sample_layout layout;
+  std::vector<onset_candidate> candidates; // in sample order
+  std::vector<uint32_t> by_strength;       // candidates, weakest first
+  float threshold;
+  // set_threshold() holds edit_lock while it changes the regions, and
+  // counts each change in edit_count
+  std::mutex edit_lock;
+  std::atomic<unsigned> edit_count;
   std::unique_ptr<cairo_image> cimg;
   Cairo::RefPtr<Cairo::ImageSurface> img;
 
+  int64_t region_index(int64_t sample) const;
+  void draw(region_map& regions);
+  void add_boundary(int64_t index, int64_t sample, std::vector<int64_t>& touched);
+  void remove_boundary(int64_t index, std::vector<int64_t>& touched);
+  void repair(std::vector<int64_t>& touched, std::vector<int64_t>& changed);
+  void outline_again(const std::vector<int64_t>& touched);
+
 public:
-  grainmap(const std::string& path);
+  // If path is a directory, every audio file under it is decoded in
+  // parallel and laid out as one corpus, in name order.
+  // fc, if given, is reset and reused for coloring, so repeated loads
+  // keep its storage warm.  progress, if given, is kept up to date and
+  // checked for cancellation, which throws load_cancelled.  Throws
+  // load_error if path cannot be read as audio.
+  grainmap(const std::string& path, five_color* fc = 0,
+           const map_options& options = map_options(),
+           load_progress* progress = 0);
   float** get_audio();
   int channel_count();
-  void lookup(int x, int y, int& start, int& stop, int& starti, int& endi);
+  void lookup(int x, int y, int64_t& start, int64_t& stop,
+              int64_t& starti, int64_t& endi);
+  // lookup() for other threads than the one calling set_threshold():
+  // false, leaving the region as it was, while an edit is under way.
+  // edits is the edits() the region was looked up at.
+  bool try_lookup(int x, int y, int64_t& start, int64_t& stop,
+                  int64_t& starti, int64_t& endi, unsigned& edits);
+  // bumped by every set_threshold() that changes the regions
+  unsigned edits() const;
+  // Hilbert index that sample falls on, kept within the region
+  // lookup() returned as start, stop, starti, endi
+  int64_t sample_index(int64_t sample, int64_t start, int64_t stop,
+                       int64_t starti, int64_t endi) const;
+  void coords(int64_t index, int& x, int& y) const;
+  int64_t index(int x, int y) const;
+  // null unless the map was loaded with draw_image and fits in one
+  // surface
   Cairo::RefPtr<Cairo::ImageSurface> get_surface();
+
+  int get_nsize() const;
+  int64_t frame_count() const;
+  const sample_layout& get_layout() const;
+  // the files the map was made from; one unless it is a corpus
+  const std::vector<std::string>& get_sources() const;
+  // which source sample, such as a region_start's, comes from, and
+  // where in that file
+  void locate_sample(int64_t sample, int& source, int64_t& offset) const;
+  // bytes held, roughly
+  size_t memory_size() const;
+  const region_table& get_regions() const;
+  const envelope& get_envelope() const;
+  const outline_table& get_outlines() const;
+  // Followed peaks of pixels [first, first+n) of the map drawn 2^level
+  // times smaller on a side, the follower warmed up on the pixels
+  // before first.  At level 0 these match the drawn image's.
+  void followed_peaks(int level, int64_t first, int64_t n, float* out) const;
+
+  float get_threshold() const;
+  // Start regions at the candidates stronger than threshold instead,
+  // redoing only the regions around those that switch, and leaving in
+  // changed the starts of the regions, new or old, whose extent or
+  // color is not what it was.  threshold is kept between
+  // min_threshold and the strongest candidate short of the starts of
+  // files, which always start regions.
+  static constexpr float min_threshold = 1e-3f;
+  void set_threshold(float threshold, std::vector<int64_t>& changed);
+  // Start a region at hilbert index, at the first sample it stands
+  // for, or join the region containing index
+  // to the one before it.  changed is as for set_threshold(), and both
+  // do nothing, returning false, if there is no boundary to add or
+  // remove.  A later set_threshold() only undoes these where the
+  // candidates that switch land.
+  bool split(int64_t index, std::vector<int64_t>& changed);
+  bool merge(int64_t index, std::vector<int64_t>& changed);
+
+  // whether options.cache_dir holds an up to date analysis of path
+  static bool analysis_cached(const std::string& path,
+                              const map_options& options);
+
+  // Smallest grid that gives frames about a millisecond per pixel,
+  // with the full image, if drawn, within memory_budget
+  static int pick_nsize(int64_t frames, size_t memory_budget,
+                        bool draw_image = true);
+};
+
+// Loads a grainmap on a thread of its own.  done is called on that
+// thread with the map, or null and why if the load failed, or null and
+// an empty string if it was cancelled.  Destroying the loader cancels
+// the load and waits for the thread.
+class grainmap_loader {
+public:
+  typedef std::function<std::shared_ptr<grainmap>(load_progress&)> load_function;
+  typedef std::function<void(std::shared_ptr<grainmap>,
+                             const std::string& error)> done_function;
+
+  grainmap_loader(const std::string& path, const map_options& options,
+                  const done_function& done);
+  // runs load, which may throw load_cancelled or anything else, instead
+  // of constructing the map directly
+  grainmap_loader(const load_function& load, const done_function& done);
+  ~grainmap_loader();
+  void cancel();
+  double fraction() const;
+
+private:
+  load_progress progress;
+  std::thread worker;
+
+  void run(const load_function& load, const done_function& done);
 };
 
 #endif //GRAINMAP_H
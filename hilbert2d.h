@@ -0,0 +1,110 @@
+/* hilbert2d.h
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HILBERT2D_H
+#define HILBERT2D_H
+
+#include "hilbert.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Two-dimensional Hilbert curve on a 2^N by 2^N grid, with N fixed at
+// compile time so the bit loops unroll.  These trace the same curve as
+// hilbert_i2c() and hilbert_c2i() with nDims = 2 and nBits = N.
+
+template <int N>
+static inline void hilbert2d_i2c(bitmask_t index, bitmask_t coords[2]) {
+  bitmask_t x = 0, y = 0;
+  for (int k=0; k<N; k++) {
+    bitmask_t s = (bitmask_t)1 << k;
+    bitmask_t rx = 1 & index >> 1;
+    bitmask_t ry = 1 & (index ^ rx);
+    if (!ry) {
+      if (rx) {
+        x = s-1 - x;
+        y = s-1 - y;
+      }
+      bitmask_t t = x; x = y; y = t;
+    }
+    x += s*rx;
+    y += s*ry;
+    index >>= 2;
+  }
+  coords[0] = y;
+  coords[1] = x;
+}
+
+template <int N>
+static inline bitmask_t hilbert2d_c2i(const bitmask_t coords[2]) {
+  const bitmask_t n = (bitmask_t)1 << N;
+  bitmask_t x = coords[1], y = coords[0], index = 0;
+  for (int k=N-1; k>=0; k--) {
+    bitmask_t s = (bitmask_t)1 << k;
+    bitmask_t rx = (x & s) != 0;
+    bitmask_t ry = (y & s) != 0;
+    index += s*s*(3*rx ^ ry);
+    if (!ry) {
+      if (rx) {
+        x = n-1 - x;
+        y = n-1 - y;
+      }
+      bitmask_t t = x; x = y; y = t;
+    }
+  }
+  return index;
+}
+
+template <int N>
+static inline bool hilbert2d_in_bounds(const bitmask_t coords[2]) {
+  // coordinates are unsigned, so stepping off the low edge wraps
+  // around and fails this too
+  return coords[0] < ((bitmask_t)1 << N) && coords[1] < ((bitmask_t)1 << N);
+}
+
+// Grid sizes the fixed-size kernels are instantiated for
+enum { min_nsize = 6, max_nsize = 16 };
+
+// Call f.template run<N>() with N = nsize.  Callers pick the size once
+// per map and everything under run() is compiled for that size.
+template <class F>
+static inline void with_nsize(int nsize, F& f) {
+  switch (nsize) {
+  case 6: f.template run<6>(); break;
+  case 7: f.template run<7>(); break;
+  case 8: f.template run<8>(); break;
+  case 9: f.template run<9>(); break;
+  case 10: f.template run<10>(); break;
+  case 11: f.template run<11>(); break;
+  case 12: f.template run<12>(); break;
+  case 13: f.template run<13>(); break;
+  case 14: f.template run<14>(); break;
+  case 15: f.template run<15>(); break;
+  case 16: f.template run<16>(); break;
+  default:
+    // callers check min_nsize/max_nsize; carrying on would leave f's
+    // results unset and fail somewhere far from here
+    fprintf(stderr, "with_nsize: unsupported nsize %d\n", nsize);
+    abort();
+  }
+}
+
+#endif //HILBERT2D_H
@@ -0,0 +1,160 @@
+/* library.cpp
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "library.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+map_library::map_library(const map_options& options, size_t memory_budget)
+  : options(options),
+    memory_budget(memory_budget),
+    resident(0),
+    worker_progress(0),
+    quit(false),
+    worker(&map_library::prefetch_loop, this)
+{
+}
+
+map_library::~map_library() {
+  {
+    lock_guard<mutex> guard(lock);
+    quit = true;
+    if (worker_progress)
+      worker_progress->cancel();
+  }
+  changed.notify_all();
+  worker.join();
+}
+
+// Move path's map, if resident, to the front.  Called with lock held.
+shared_ptr<grainmap> map_library::touch(const string& path) {
+  auto it = index.find(path);
+  if (it == index.end())
+    return shared_ptr<grainmap>();
+  lru.splice(lru.begin(), lru, it->second);
+  return lru.front().map;
+}
+
+// Add map at the front, then drop unheld maps from the back until the
+// rest fit.  Called with lock held.
+void map_library::insert(const string& path, const shared_ptr<grainmap>& map) {
+  if (touch(path))
+    return;
+  entry e = {path, map, map->memory_size()};
+  lru.push_front(e);
+  index[path] = lru.begin();
+  resident += e.size;
+
+  auto it = lru.end();
+  while (resident > memory_budget && it != lru.begin()) {
+    --it;
+    if (it == lru.begin() || it->map.use_count() > 1)
+      continue;
+    resident -= it->size;
+    index.erase(it->path);
+    it = lru.erase(it);
+  }
+}
+
+shared_ptr<grainmap> map_library::get(const string& path, load_progress* progress) {
+  unique_lock<mutex> guard(lock);
+  while (loading.count(path)) {
+    if (progress && progress->cancelled())
+      throw load_cancelled();
+    changed.wait_for(guard, chrono::milliseconds(50));
+  }
+  shared_ptr<grainmap> map = touch(path);
+  if (map)
+    return map;
+
+  loading.insert(path);
+  guard.unlock();
+  try {
+    map.reset(new grainmap(path, 0, options, progress));
+  } catch (...) {
+    guard.lock();
+    loading.erase(path);
+    changed.notify_all();
+    throw;
+  }
+  guard.lock();
+  loading.erase(path);
+  insert(path, map);
+  changed.notify_all();
+  return map;
+}
+
+shared_ptr<grainmap> map_library::find(const string& path) {
+  lock_guard<mutex> guard(lock);
+  return touch(path);
+}
+
+void map_library::prefetch(const vector<string>& paths) {
+  {
+    lock_guard<mutex> guard(lock);
+    pending.assign(paths.rbegin(), paths.rend());
+    if (worker_progress &&
+        std::find(paths.begin(), paths.end(), prefetching) == paths.end())
+      worker_progress->cancel();
+  }
+  changed.notify_all();
+}
+
+size_t map_library::resident_size() {
+  lock_guard<mutex> guard(lock);
+  return resident;
+}
+
+void map_library::prefetch_loop() {
+  unique_lock<mutex> guard(lock);
+  for (;;) {
+    while (!quit && pending.empty())
+      changed.wait(guard);
+    if (quit)
+      return;
+    string path = pending.back();
+    pending.pop_back();
+    if (index.count(path) || loading.count(path))
+      continue;
+
+    load_progress progress;
+    loading.insert(path);
+    prefetching = path;
+    worker_progress = &progress;
+    guard.unlock();
+    shared_ptr<grainmap> map;
+    try {
+      map.reset(new grainmap(path, 0, options, &progress));
+    } catch (...) {
+      // cancelled, or unreadable, which get() will report if the
+      // path is ever wanted
+    }
+    guard.lock();
+    worker_progress = 0;
+    prefetching.clear();
+    loading.erase(path);
+    if (map)
+      insert(path, map);
+    changed.notify_all();
+  }
+}
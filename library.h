@@ -0,0 +1,88 @@
+/* library.h
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include "grainmap.h"
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Analyzed maps kept resident for quick switching between files, up
+// to memory_budget bytes.  Past the budget, the least recently used
+// maps that nobody else holds are dropped; with options.cache_dir set,
+// bringing one back only costs decoding the audio again.  A background
+// thread loads whatever prefetch() last asked for.
+class map_library {
+public:
+  map_library(const map_options& options, size_t memory_budget);
+  ~map_library();
+
+  // The map for path, loaded here unless it is resident.  If another
+  // thread is already loading it, this waits for that instead.
+  // progress, if given, is checked for cancellation, which throws
+  // load_cancelled; a path that cannot be loaded throws load_error.
+  std::shared_ptr<grainmap> get(const std::string& path,
+                                load_progress* progress = 0);
+  // the map for path if it is resident, without loading or waiting
+  std::shared_ptr<grainmap> find(const std::string& path);
+  // Load paths in the background, most likely first, replacing any
+  // earlier request and cancelling a load no longer asked for
+  void prefetch(const std::vector<std::string>& paths);
+  size_t resident_size();
+
+private:
+  struct entry {
+    std::string path;
+    std::shared_ptr<grainmap> map;
+    // memory_size() when inserted; edits change it later, and reading
+    // it then would race with them
+    size_t size;
+  };
+  typedef std::list<entry> map_list;
+
+  const map_options options;
+  const size_t memory_budget;
+
+  std::mutex lock;
+  std::condition_variable changed;
+  map_list lru; // most recently used first
+  std::map<std::string, map_list::iterator> index;
+  size_t resident;
+  std::vector<std::string> pending; // prefetch() paths not yet taken
+  std::set<std::string> loading;    // paths get() or the worker is loading
+  std::string prefetching;          // the one the worker is loading
+  load_progress* worker_progress;   // and its progress, while it does
+  bool quit;
+  std::thread worker;
+
+  std::shared_ptr<grainmap> touch(const std::string& path);
+  void insert(const std::string& path, const std::shared_ptr<grainmap>& map);
+  void prefetch_loop();
+};
+
+#endif //LIBRARY_H
@@ -0,0 +1,90 @@
+/* parallel.h
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+// thread count to use when the caller passes 0
+inline int default_threads() {
+  unsigned n = std::thread::hardware_concurrency();
+  return n ? n : 1;
+}
+
+// Split [0,n) into one contiguous chunk per thread and call
+// f(thread, begin, end) for each.  The calling thread takes chunk 0.
+template <class F>
+void parallel_for(int threads, size_t n, F f) {
+  if (threads <= 0)
+    threads = default_threads();
+  if ((size_t)threads > n)
+    threads = n ? n : 1;
+
+  std::vector<std::thread> workers;
+  for (int t=1; t<threads; t++)
+    workers.push_back(std::thread(f, t, n*t/threads, n*(t+1)/threads));
+  f(0, (size_t)0, n/threads);
+  for (size_t t=0; t<workers.size(); t++)
+    workers[t].join();
+}
+
+// Call f(thread, i) for each i in [0,n), handing indexes out one at a
+// time to whichever thread is free, for items of uneven cost
+template <class F>
+void parallel_each(int threads, size_t n, F f) {
+  if (threads <= 0)
+    threads = default_threads();
+  std::atomic<size_t> next(0);
+  parallel_for(threads, threads, [&](int t, size_t, size_t) {
+      for (size_t i; (i = next++) < n; )
+        f(t, i);
+    });
+}
+
+class thread_barrier {
+  std::mutex m;
+  std::condition_variable cv;
+  int threads, waiting;
+  unsigned phase;
+
+public:
+  thread_barrier(int threads) : threads(threads), waiting(0), phase(0) {}
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(m);
+    unsigned p = phase;
+    if (++waiting == threads) {
+      waiting = 0;
+      phase++;
+      cv.notify_all();
+    } else {
+      while (p == phase)
+        cv.wait(lock);
+    }
+  }
+};
+
+#endif //PARALLEL_H
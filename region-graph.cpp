@@ -0,0 +1,449 @@
+/* region-graph.cpp
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "region-graph.h"
+
+#include <stdint.h>
+#include <algorithm>
+
+using namespace std;
+
+// Walk clockwise around r's boundary, calling add with the entry of
+// each neighbouring region of regions met along the way, and side with
+// each boundary pixel and the outward normal of its side being passed.
+template <int N, class M, class F, class S>
+static inline void traverse_region(region r,
+                                   const M& regions,
+                                   F add,
+                                   S side)
+{
+  //printf("traverse begin\n");
+
+  bitmask_t coords[2];
+  hilbert2d_i2c<N>(r.start, coords);
+
+  int nx, ny;
+  if (r.start) {
+    bitmask_t last_coords[2];
+    hilbert2d_i2c<N>(r.start-1, last_coords);
+    nx = last_coords[0] - coords[0];
+    ny = last_coords[1] - coords[1];
+  } else {
+    nx = 0;
+    ny = -1;
+  }
+  bitmask_t foreign_coords[2];
+  foreign_coords[0] = coords[0] + nx;
+  foreign_coords[1] = coords[1] + ny;
+
+  // Each boundary side is passed once, in order, and the walk is over
+  // when it comes back to the first.  (The first outside pixel can
+  // also lie beyond a later side, so it doesn't mark the end.)
+  bitmask_t first_coords[2] = {coords[0], coords[1]};
+  const int first_nx = nx, first_ny = ny;
+  int sides = 0;
+  auto boundary = [&]() {
+    if (sides++ && coords[0] == first_coords[0] && coords[1] == first_coords[1] &&
+        nx == first_nx && ny == first_ny)
+      return true;
+    side(coords, nx, ny);
+    return false;
+  };
+
+  region foreign_region = {0,-1};
+  for (;;) {
+    int64_t index;
+    if (!hilbert2d_in_bounds<N>(foreign_coords) ||
+        foreign_region.contains(index=hilbert2d_c2i<N>(foreign_coords)))
+    {
+      if (boundary())
+        break;
+    } else {
+      //printf("traverse handle %d %d\n", index, r.contains(index));
+      if (r.contains(index)) {
+        coords[0] = foreign_coords[0];
+        coords[1] = foreign_coords[1];
+        // rotate normal counterclockwise
+        //printf("traverse rotate normal counterclockwise\n");
+        int tnx = nx;
+        nx = ny;
+        ny = -tnx;
+        // the pixel now behind is outside the side just walked, so
+        // this side is on the boundary too
+        if (boundary())
+          break;
+      } else {
+        //printf("traverse new region\n");
+        // new region
+        if (boundary())
+          break;
+        auto it = find_vertex(regions, index);
+        assert(it != regions.end());
+        assert(it->first != r.start);
+        //printf("add edge %p -> %p\n", vtx, it->second);
+        add(it);
+        foreign_region.start = it->first;
+        ++it;
+        foreign_region.end = it == regions.end() ? INT64_MAX : it->first;
+      }
+    }
+
+    // move clockwise-normal
+    coords[0] -= ny;
+    coords[1] += nx;
+    if (!(hilbert2d_in_bounds<N>(coords) &&
+          r.contains(hilbert2d_c2i<N>(coords))))
+    {
+      //printf("traverse go back\n");
+      // go back
+      coords[0] += ny;
+      coords[1] -= nx;
+
+      // rotate normal clockwise
+      int tnx = nx;
+      nx = -ny;
+      ny = tnx;
+    }
+
+    foreign_coords[0] = coords[0] + nx;
+    foreign_coords[1] = coords[1] + ny;
+  }
+}
+
+template <int N, class F, class S>
+static void traverse_regions(region_map& regions, F add, S& side) {
+  for (auto it=regions.begin(); it != regions.end();) {
+    region r;
+    r.start = it->first;
+    auto self = it;
+    ++it;
+    r.end = it == regions.end() ? INT64_MAX : it->first;
+    side(r.start, true);
+    traverse_region<N>(r, regions, [&](region_map::const_iterator other) {
+        add(self, other);
+      }, [&](const bitmask_t coords[2], int nx, int ny) {
+        side(coords, nx, ny);
+      });
+    side(r.start, false);
+  }
+}
+
+template <int N, class F>
+static void traverse_regions(region_map& regions, F add) {
+  struct {
+    void operator()(int64_t, bool) {}
+    void operator()(const bitmask_t coords[2], int nx, int ny) {}
+  } none;
+  traverse_regions<N>(regions, add, none);
+}
+
+// Side handler for traverse_regions() that keeps the corners where
+// each region's outline turns
+class outline_sides {
+  region_outlines& out;
+  size_t begin;
+  int dx, dy;
+
+  void finish() {
+    vector<outline_point>& points = out.points;
+    // the first corner is mid-side if the walk ended going the way it
+    // began
+    if (points.size() - begin > 1) {
+      const outline_point& a = points[begin];
+      const outline_point& b = points[begin+1];
+      int fx = (b.x > a.x) - (b.x < a.x);
+      int fy = (b.y > a.y) - (b.y < a.y);
+      if (fx == dx && fy == dy)
+        points.erase(points.begin() + begin);
+    }
+    outline_point lo = points[begin], hi = points[begin];
+    for (size_t i=begin; i<points.size(); i++) {
+      lo.x = min(lo.x, points[i].x);
+      lo.y = min(lo.y, points[i].y);
+      hi.x = max(hi.x, points[i].x);
+      hi.y = max(hi.y, points[i].y);
+    }
+    out.lo.push_back(lo);
+    out.hi.push_back(hi);
+    out.offsets.push_back(points.size());
+  }
+
+public:
+  outline_sides(region_outlines& out) : out(out) {}
+
+  void operator()(int64_t start, bool starting) {
+    if (starting) {
+      out.starts.push_back(start);
+      begin = out.points.size();
+      dx = dy = 0;
+    } else {
+      finish();
+    }
+  }
+
+  void operator()(const bitmask_t coords[2], int nx, int ny) {
+    // the walk runs along (-ny, nx), and a side starts at
+    // coords + (1 + n - direction)/2
+    int sx = -ny, sy = nx;
+    if (sx == dx && sy == dy)
+      return;
+    dx = sx;
+    dy = sy;
+    outline_point p = {(int32_t)((2*(int64_t)coords[0] + 1 + nx - sx)/2),
+                       (int32_t)((2*(int64_t)coords[1] + 1 + ny - sy)/2)};
+    out.points.push_back(p);
+  }
+};
+
+namespace {
+  struct edges_kernel {
+    five_color& fc;
+    region_map& regions;
+    region_outlines* outlines;
+
+    template <int N> void run() {
+      auto add = [&](region_map::iterator self, region_map::const_iterator other) {
+        fc.add_edge(self->second, other->second);
+      };
+      if (outlines) {
+        outline_sides sides(*outlines);
+        traverse_regions<N>(regions, add, sides);
+      } else {
+        traverse_regions<N>(regions, add);
+      }
+    }
+  };
+
+  struct outline_kernel {
+    region_map& regions;
+    region_outlines& outlines;
+
+    template <int N> void run() {
+      outline_sides sides(outlines);
+      traverse_regions<N>(regions, [](region_map::iterator,
+                                      region_map::const_iterator) {}, sides);
+    }
+  };
+
+  struct boundary_kernel {
+    region_map& regions;
+    region_pairs& pairs;
+
+    template <int N> void run() {
+      traverse_regions<N>(regions, [&](region_map::iterator self,
+                                       region_map::const_iterator other) {
+          pairs.push_back(make_pair(self->first, other->first));
+        });
+    }
+  };
+
+  struct raster_kernel {
+    region_map& regions;
+    region_pairs& pairs;
+
+    template <int N> void run() {
+      const int64_t w = 1 << N;
+      vector<int64_t> ids(w*w);
+
+      for (auto it=regions.begin(); it != regions.end();) {
+        int64_t start = it->first;
+        ++it;
+        int64_t end = it == regions.end() ? w*w : min(it->first, w*w);
+        for (int64_t i=start; i<end; i++) {
+          bitmask_t coords[2];
+          hilbert2d_i2c<N>(i, coords);
+          ids[coords[1]*w + coords[0]] = start;
+        }
+      }
+
+      for (int64_t y=0; y<w; y++) {
+        for (int64_t x=0; x<w; x++) {
+          int64_t a = ids[y*w + x];
+          int64_t right = x+1 < w ? ids[y*w + x+1] : a;
+          int64_t down = y+1 < w ? ids[(y+1)*w + x] : a;
+          if (right != a) {
+            pairs.push_back(make_pair(a, right));
+            pairs.push_back(make_pair(right, a));
+          }
+          if (down != a) {
+            pairs.push_back(make_pair(a, down));
+            pairs.push_back(make_pair(down, a));
+          }
+        }
+      }
+    }
+  };
+}
+
+namespace {
+  // the region of regions starting at start
+  region find_region(const region_table& regions, int64_t start) {
+    auto it = regions.find(start);
+    assert(it != regions.end());
+    region r = {start, INT64_MAX};
+    if (++it != regions.end())
+      r.end = it->first;
+    return r;
+  }
+
+  struct neighbours_kernel {
+    const region_table& regions;
+    int64_t start;
+    vector<int64_t>& neighbours;
+
+    template <int N> void run() {
+      traverse_region<N>(find_region(regions, start), regions,
+                         [&](region_table::const_iterator other) {
+                           neighbours.push_back(other->first);
+                         },
+                         [](const bitmask_t coords[2], int nx, int ny) {});
+    }
+  };
+
+  struct append_outline_kernel {
+    const region_table& regions;
+    int64_t start;
+    region_outlines& outlines;
+
+    template <int N> void run() {
+      outline_sides sides(outlines);
+      sides(start, true);
+      traverse_region<N>(find_region(regions, start), regions,
+                         [](region_table::const_iterator) {},
+                         [&](const bitmask_t coords[2], int nx, int ny) {
+                           sides(coords, nx, ny);
+                         });
+      sides(start, false);
+    }
+  };
+}
+
+void region_neighbours(const region_table& regions, int64_t start, int nsize,
+                       vector<int64_t>& neighbours)
+{
+  neighbours_kernel k = {regions, start, neighbours};
+  with_nsize(nsize, k);
+}
+
+void append_outline(const region_table& regions, int64_t start, int nsize,
+                    region_outlines& outlines)
+{
+  append_outline_kernel k = {regions, start, outlines};
+  with_nsize(nsize, k);
+}
+
+void construct_edges(five_color& fc, region_map& regions, int nsize,
+                     region_outlines* outlines)
+{
+  if (outlines)
+    outlines->clear();
+  edges_kernel k = {fc, regions, outlines};
+  with_nsize(nsize, k);
+}
+
+void extract_outlines(region_map& regions, int nsize, region_outlines& outlines) {
+  outlines.clear();
+  outline_kernel k = {regions, outlines};
+  with_nsize(nsize, k);
+}
+
+void region_outlines::clear() {
+  starts.clear();
+  offsets.assign(1, 0);
+  points.clear();
+  lo.clear();
+  hi.clear();
+}
+
+int region_outlines::find(int64_t index) const {
+  auto it = upper_bound(starts.begin(), starts.end(), index);
+  return it == starts.begin() ? -1 : (int)(it - starts.begin()) - 1;
+}
+
+static void normalize(region_pairs& pairs) {
+  sort(pairs.begin(), pairs.end());
+  pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+}
+
+void boundary_adjacency(region_map& regions, int nsize, region_pairs& pairs) {
+  pairs.clear();
+  boundary_kernel k = {regions, pairs};
+  with_nsize(nsize, k);
+  normalize(pairs);
+}
+
+void raster_adjacency(region_map& regions, int nsize, region_pairs& pairs) {
+  pairs.clear();
+  raster_kernel k = {regions, pairs};
+  with_nsize(nsize, k);
+  normalize(pairs);
+}
+
+void outline_table::assign(const region_outlines& flat) {
+  table.clear();
+  point_count = 0;
+  replace(0, INT64_MAX, flat);
+}
+
+void outline_table::flatten(region_outlines& flat) const {
+  flat.clear();
+  flat.starts.reserve(table.size());
+  flat.offsets.reserve(table.size() + 1);
+  flat.points.reserve(point_count);
+  flat.lo.reserve(table.size());
+  flat.hi.reserve(table.size());
+  for (auto it=table.begin(); it!=table.end(); ++it) {
+    flat.starts.push_back(it->first);
+    flat.points.insert(flat.points.end(), it->second.points.begin(),
+                       it->second.points.end());
+    flat.offsets.push_back(flat.points.size());
+    flat.lo.push_back(it->second.lo);
+    flat.hi.push_back(it->second.hi);
+  }
+}
+
+int64_t outline_table::find(int64_t index) const {
+  auto it = table.upper_bound(index);
+  return it == table.begin() ? -1 : (--it)->first;
+}
+
+const outline_table::outline& outline_table::at(int64_t start) const {
+  auto it = table.find(start);
+  assert(it != table.end());
+  return it->second;
+}
+
+void outline_table::replace(int64_t first, int64_t last,
+                            const region_outlines& with) {
+  auto it = table.lower_bound(first), stop = table.lower_bound(last);
+  while (it != stop) {
+    point_count -= it->second.points.size();
+    it = table.erase(it);
+  }
+  for (int i=0; i<with.size(); i++) {
+    it = table.insert(stop, make_pair(with.starts[i], outline()));
+    outline& o = it->second;
+    o.points.assign(with.points.begin() + with.offsets[i],
+                    with.points.begin() + with.offsets[i+1]);
+    o.lo = with.lo[i];
+    o.hi = with.hi[i];
+    point_count += o.points.size();
+  }
+}
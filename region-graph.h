@@ -0,0 +1,148 @@
+/* region-graph.h
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REGION_GRAPH_H
+#define REGION_GRAPH_H
+
+#include "five-color.h"
+#include "hilbert2d.h"
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <assert.h>
+#include <stdint.h>
+
+struct region {
+  int64_t start, end;
+
+  bool contains(int64_t point) {
+    return point >= start && point < end;
+  }
+};
+
+typedef std::map<int64_t,five_color::vertex*> region_map;
+
+struct region_start {
+  int64_t sample;
+  int color;
+};
+
+// hilbert index -> where the region starting there begins in the audio
+typedef std::map<int64_t,region_start> region_table;
+
+template <class M>
+static inline typename M::const_iterator find_vertex(const M& regions, int64_t index) {
+  assert(index >= 0);
+  return --regions.upper_bound(index);
+}
+
+// TODO maybe use this elsewhere
+template <int N>
+static inline int64_t lookup_index(bitmask_t x, bitmask_t y) {
+  bitmask_t coords[2];
+  coords[0] = x;
+  coords[1] = y;
+  return hilbert2d_c2i<N>(coords);
+}
+
+typedef std::vector<std::pair<int64_t,int64_t> > region_pairs;
+
+struct outline_point {
+  int32_t x, y;
+};
+
+// Each region's outer boundary as a polygon through pixel corners,
+// clockwise on screen, with a corner only where it turns.  Region i,
+// in region_map order, starts at hilbert index starts[i], has corners
+// points[offsets[i]] up to points[offsets[i+1]] and lies within lo[i]
+// to hi[i].
+struct region_outlines {
+  std::vector<int64_t> starts;
+  std::vector<size_t> offsets;
+  std::vector<outline_point> points;
+  std::vector<outline_point> lo, hi;
+
+  region_outlines() : offsets(1, 0) {}
+
+  void clear();
+  int size() const { return starts.size(); }
+  // the region containing hilbert index, or -1 before the first
+  int find(int64_t index) const;
+};
+
+// The same outlines keyed by region start, for maps whose regions are
+// edited: replacing some costs O(log n) plus their points.
+class outline_table {
+public:
+  struct outline {
+    std::vector<outline_point> points;
+    outline_point lo, hi;
+  };
+  typedef std::map<int64_t, outline>::const_iterator const_iterator;
+
+  outline_table() : point_count(0) {}
+  void assign(const region_outlines& flat);
+  void flatten(region_outlines& flat) const;
+
+  size_t size() const { return table.size(); }
+  size_t points() const { return point_count; }
+  const_iterator begin() const { return table.begin(); }
+  const_iterator end() const { return table.end(); }
+  // start of the region containing hilbert index, or -1 before the
+  // first
+  int64_t find(int64_t index) const;
+  // the outline of the region starting at start, which must be one
+  const outline& at(int64_t start) const;
+  // put all of with in place of the regions starting from first up to
+  // last
+  void replace(int64_t first, int64_t last, const region_outlines& with);
+
+private:
+  std::map<int64_t, outline> table;
+  size_t point_count;
+};
+
+// Add an edge in each direction for every two regions sharing a pixel
+// side, found by walking each region's boundary.  The same walk fills
+// outlines if it is given.
+void construct_edges(five_color& fc, region_map& regions, int nsize,
+                     region_outlines* outlines = 0);
+
+// Just the outlines from construct_edges()
+void extract_outlines(region_map& regions, int nsize, region_outlines& outlines);
+
+// The same walks over one region of a region_table, for edits that
+// only touch a few: the starts of the regions sharing a side with the
+// one starting at start, possibly repeated, and its outline appended
+// to outlines.
+void region_neighbours(const region_table& regions, int64_t start, int nsize,
+                       std::vector<int64_t>& neighbours);
+void append_outline(const region_table& regions, int64_t start, int nsize,
+                    region_outlines& outlines);
+
+// The same adjacency as sorted (start, start) pairs, one per
+// direction.  boundary_adjacency() walks boundaries like
+// construct_edges(); raster_adjacency() compares neighbouring pixels
+// of a region-ID image instead, as an independent check.
+void boundary_adjacency(region_map& regions, int nsize, region_pairs& pairs);
+void raster_adjacency(region_map& regions, int nsize, region_pairs& pairs);
+
+#endif //REGION_GRAPH_H
@@ -0,0 +1,184 @@
+/* tiles.cpp
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tiles.h"
+#include "grainmap.h"
+#include "hilbert2d.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+using namespace Cairo;
+
+namespace {
+  // Paints one tile of the level whose grid is 2^M pixels square.
+  struct tile_kernel {
+    const grainmap& gm;
+    int level, tx, ty;
+    bool outlines;
+    RefPtr<ImageSurface> surface;
+
+    template <int M> void run() {
+      const int64_t side = (int64_t)1 << M;
+      const int w = (int)min(side, (int64_t)map_tiles::tile_size);
+      const int hw = w+2;
+      const int shift = 2*level;
+      const int64_t x0 = (int64_t)tx*w - 1;
+      const int64_t y0 = (int64_t)ty*w - 1;
+      const region_table& regions = gm.get_regions();
+
+      // full resolution index of the first pixel under each of the
+      // tile's pixels and the ring around them, -1 off the map
+      vector<int64_t> index((size_t)hw*hw);
+      for (int y=0; y<hw; y++) {
+        for (int x=0; x<hw; x++) {
+          bitmask_t coords[2];
+          coords[0] = x0 + x;
+          coords[1] = y0 + y;
+          index[y*hw + x] = hilbert2d_in_bounds<M>(coords) ?
+            (int64_t)hilbert2d_c2i<M>(coords) << shift : -1;
+        }
+      }
+
+      // the tile is one stretch of the curve at its level, shaded from
+      // the same followed peaks as the drawn image
+      int64_t first = INT64_MAX;
+      for (int y=1; y<=w; y++)
+        for (int x=1; x<=w; x++)
+          first = min(first, index[y*hw + x] >> shift);
+      vector<float> levels((size_t)w*w);
+      gm.followed_peaks(level, first, levels.size(), &levels[0]);
+
+      surface = ImageSurface::create(FORMAT_RGB24, w, w);
+      surface->flush();
+      unsigned char* data = surface->get_data();
+      const int stride = surface->get_stride();
+      int64_t reg_start = 0, reg_end = -1;
+      int color = 0;
+      for (int y=0; y<w; y++) {
+        uint32_t* row = (uint32_t*)(data + (size_t)y*stride);
+        for (int x=0; x<w; x++) {
+          const int64_t* c = &index[(y+1)*hw + x+1];
+          int64_t start = *c;
+          int64_t end = start + ((int64_t)1 << shift);
+          if (start < reg_start || start >= reg_end) {
+            auto it = --regions.upper_bound(start);
+            reg_start = it->first;
+            color = it->second.color;
+            ++it;
+            reg_end = it == regions.end() ? INT64_MAX : it->first;
+          }
+
+          // outline pixels holding a region boundary or next to
+          // another region or the edge of the map
+          bool edge = false;
+          if (outlines) {
+            const int64_t around[] = {c[-hw-1], c[-hw], c[-hw+1], c[-1],
+                                      c[1], c[hw-1], c[hw], c[hw+1]};
+            edge = end > reg_end;
+            for (int i=0; i<8; i++)
+              edge = edge || around[i] < reg_start || around[i] >= reg_end;
+          }
+
+          uint32_t pixel = shade_pixel(color, levels[(start >> shift) - first]);
+          row[x] = edge ? outline_pixel(pixel) : pixel;
+        }
+      }
+      surface->mark_dirty();
+    }
+  };
+}
+
+map_tiles::map_tiles(const grainmap& gm, size_t max_tiles, bool outlines)
+  : gm(gm),
+    max_tiles(max_tiles),
+    outlines(outlines)
+{
+  assert(max_tiles > 0);
+}
+
+int map_tiles::levels() const {
+  return max(gm.get_nsize() - tile_nsize, 0) + 1;
+}
+
+int64_t map_tiles::side(int level) const {
+  return (int64_t)1 << (gm.get_nsize() - level);
+}
+
+int map_tiles::tile_side(int level) const {
+  return (int)min(side(level), (int64_t)tile_size);
+}
+
+int map_tiles::tiles_across(int level) const {
+  return (int)(side(level) / tile_side(level));
+}
+
+RefPtr<ImageSurface> map_tiles::get(int level, int x, int y) {
+  assert(level >= 0 && level < levels());
+  assert(x >= 0 && x < tiles_across(level) && y >= 0 && y < tiles_across(level));
+  key k = {level, x, y};
+  auto it = index.find(k);
+  if (it != index.end()) {
+    lru.splice(lru.begin(), lru, it->second);
+    return lru.front().second;
+  }
+
+  lru.push_front(make_pair(k, render(k)));
+  index[k] = lru.begin();
+  if (index.size() > max_tiles) {
+    index.erase(lru.back().first);
+    lru.pop_back();
+  }
+  return lru.front().second;
+}
+
+void map_tiles::clear() {
+  index.clear();
+  lru.clear();
+}
+
+void map_tiles::invalidate(int64_t x0, int64_t y0, int64_t x1, int64_t y1) {
+  for (int level=0; level<levels(); level++) {
+    const int64_t span = (int64_t)tile_side(level) << level;
+    const int across = tiles_across(level);
+    const int tx0 = (int)max(x0/span, (int64_t)0);
+    const int ty0 = (int)max(y0/span, (int64_t)0);
+    const int tx1 = (int)min((x1 + span - 1)/span, (int64_t)across);
+    const int ty1 = (int)min((y1 + span - 1)/span, (int64_t)across);
+    for (int y=ty0; y<ty1; y++) {
+      for (int x=tx0; x<tx1; x++) {
+        key k = {level, x, y};
+        auto it = index.find(k);
+        if (it == index.end())
+          continue;
+        lru.erase(it->second);
+        index.erase(it);
+      }
+    }
+  }
+}
+
+RefPtr<ImageSurface> map_tiles::render(const key& k) const {
+  tile_kernel kernel = {gm, k.level, k.x, k.y, outlines};
+  with_nsize(gm.get_nsize() - k.level, kernel);
+  return kernel.surface;
+}
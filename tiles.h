@@ -0,0 +1,82 @@
+/* tiles.h
+ *
+ * Copyright 2011 Caleb Reach
+ * 
+ * This file is part of Grainmap
+ *
+ * Grainmap is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Grainmap is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Grainmap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILES_H
+#define TILES_H
+
+#include <cairomm/cairomm.h>
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <utility>
+
+class grainmap;
+
+// The map cut into square tiles at power-of-two zoom levels.  Level 0
+// is full resolution and each level up halves the side, down to one
+// tile for the whole map.  Tiles are rendered the first time they are
+// asked for, from the region table and the envelope, and the least
+// recently used are dropped once more than max_tiles are held.
+// Region outlines are baked into the tiles unless outlines is false,
+// for callers that stroke get_outlines() themselves.
+class map_tiles {
+public:
+  static const int tile_nsize = 8;
+  static const int tile_size = 1 << tile_nsize;
+
+  explicit map_tiles(const grainmap& gm, size_t max_tiles = 256,
+                     bool outlines = true);
+
+  int levels() const;
+  // pixels across the whole map at level
+  int64_t side(int level) const;
+  // pixels across one tile at level
+  int tile_side(int level) const;
+  int tiles_across(int level) const;
+
+  Cairo::RefPtr<Cairo::ImageSurface> get(int level, int x, int y);
+  void clear();
+  // drop the tiles, at every level, that show any of the full
+  // resolution pixels from x0, y0 up to x1, y1
+  void invalidate(int64_t x0, int64_t y0, int64_t x1, int64_t y1);
+
+private:
+  struct key {
+    int level, x, y;
+
+    bool operator<(const key& k) const {
+      if (level != k.level) return level < k.level;
+      if (y != k.y) return y < k.y;
+      return x < k.x;
+    }
+  };
+
+  typedef std::list<std::pair<key, Cairo::RefPtr<Cairo::ImageSurface> > > tile_list;
+
+  const grainmap& gm;
+  size_t max_tiles;
+  bool outlines;
+  tile_list lru; // most recently used first
+  std::map<key, tile_list::iterator> index;
+
+  Cairo::RefPtr<Cairo::ImageSurface> render(const key& k) const;
+};
+
+#endif //TILES_H